@@ -0,0 +1,98 @@
+#include "baud_negotiator.h"
+
+const unsigned long BaudNegotiator::SUPPORTED_BAUD_RATES[
+    NUM_SUPPORTED_BAUD_RATES] = {19200ul, 38400ul, 57600ul, 115200ul, 250000ul,
+    500000ul, 1000000ul};
+
+BaudNegotiator::BaudNegotiator(HardwareSerial* const serial,
+    const unsigned long initial_baud, const unsigned long confirm_timeout_ms) :
+    serial_(serial), confirm_timeout_ms_(confirm_timeout_ms),
+    baud_(initial_baud), confirmed_baud_(initial_baud),
+    requested_baud_(initial_baud), state_(State::IDLE), switched_ms_(0u),
+    idle_tx_room_(0) {}
+
+void BaudNegotiator::begin() {
+  if (serial_ == nullptr) {
+    return;
+  }
+  serial_->begin(baud_);
+  idle_tx_room_ = serial_->availableForWrite();
+}
+
+bool BaudNegotiator::request(const unsigned long baud) {
+  if (!isSupported(baud)) {
+    return false;
+  }
+  requested_baud_ = baud;
+  state_ = State::DRAINING;
+  return true;
+}
+
+BaudNegotiator::Event BaudNegotiator::step(const bool output_pending,
+    const unsigned long now_ms) {
+  switch (state_) {
+    default:
+    case State::IDLE:
+      break;
+    case State::DRAINING:
+      if (serial_ == nullptr) {
+        state_ = State::IDLE;
+        break;
+      }
+      // Wait for the acknowledgement to leave the transmit buffer so that
+      // the host hears it at the old rate.
+      if (output_pending || serial_->availableForWrite() < idle_tx_room_) {
+        break;
+      }
+      reopen(requested_baud_);
+      switched_ms_ = now_ms;
+      state_ = State::CONFIRMING;
+      return Event::SWITCHED;
+    case State::CONFIRMING:
+      if (now_ms - switched_ms_ < confirm_timeout_ms_) {
+        break;
+      }
+      reopen(confirmed_baud_);
+      state_ = State::IDLE;
+      return Event::FELL_BACK;
+  }
+  return Event::NONE;
+}
+
+void BaudNegotiator::confirm() {
+  if (state_ != State::CONFIRMING) {
+    return;
+  }
+  confirmed_baud_ = baud_;
+  state_ = State::IDLE;
+}
+
+BaudNegotiator::State BaudNegotiator::getState() const {
+  return state_;
+}
+
+unsigned long BaudNegotiator::getBaudRate() const {
+  return baud_;
+}
+
+bool BaudNegotiator::isSupported(const unsigned long baud) {
+  for (uint8_t i = 0u; i < NUM_SUPPORTED_BAUD_RATES; ++i) {
+    if (baud == SUPPORTED_BAUD_RATES[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void BaudNegotiator::reopen(const unsigned long baud) {
+  if (serial_ == nullptr) {
+    return;
+  }
+  // The transmit buffer is empty by now, so flush() only waits out the byte
+  // in the shift register.
+  serial_->flush();
+  serial_->end();
+  serial_->begin(baud);
+  baud_ = baud;
+  idle_tx_room_ = serial_->availableForWrite();
+}
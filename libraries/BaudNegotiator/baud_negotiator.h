@@ -0,0 +1,111 @@
+#ifndef BAUD_NEGOTIATOR_H_
+#define BAUD_NEGOTIATOR_H_
+
+#include <Arduino.h>  // For HardwareSerial
+
+// Switches a serial port to a new baud rate at the host's request without
+// risking losing contact. Once the acknowledgement of a request has been
+// transmitted at the old rate, the port is reopened at the new rate; the host
+// must then confirm within a timeout, or the port falls back to the rate that
+// was last known to work.
+class BaudNegotiator {
+ public:
+  // Stage of a rate change.
+  enum class State : int {
+    IDLE = 0,    // No rate change in progress. Default value.
+    DRAINING,    // Waiting for pending output to leave at the old rate.
+    CONFIRMING   // Running at the new rate, awaiting the host's confirmation.
+  };
+
+  // Outcomes of step() that the caller must react to.
+  enum class Event : int {
+    NONE = 0,    // Nothing happened. Default value.
+    SWITCHED,    // The port was reopened at the requested rate.
+    FELL_BACK    // Confirmation timed out; the port was reopened at the
+                 // previous rate.
+  };
+
+  // Constructs a BaudNegotiator for a serial port. The port is not opened
+  // until begin() is called.
+  //
+  // serial: The serial port to manage.
+  // initial_baud: Rate at which to open the port [bits/s].
+  // confirm_timeout_ms: Time the host has to confirm a new rate [ms].
+  BaudNegotiator(HardwareSerial* serial, unsigned long initial_baud,
+      unsigned long confirm_timeout_ms);
+
+  // Opens the serial port at the initial rate.
+  void begin();
+
+  // Requests a switch to a new rate. The caller should acknowledge the
+  // request to the host before calling step() again so that the
+  // acknowledgement goes out at the old rate.
+  //
+  // baud: The rate to switch to [bits/s].
+  // Returns: True if the rate is supported and the switch has begun.
+  bool request(unsigned long baud);
+
+  // Advances any rate change in progress. Should be called from loop().
+  //
+  // output_pending: Whether the caller still holds output that should be sent
+  //                 before the rate changes.
+  // now_ms: The current time, as from millis() [ms].
+  // Returns: What happened during this call. The caller should discard any
+  //          partially received input after a rate change.
+  Event step(bool output_pending, unsigned long now_ms);
+
+  // Confirms that the host is communicating at the new rate. Has no effect
+  // unless a confirmation is awaited.
+  void confirm();
+
+  // Retrieves the state of any rate change.
+  //
+  // Returns: The current state.
+  State getState() const;
+
+  // Retrieves the rate the port is currently open at.
+  //
+  // Returns: The current rate [bits/s].
+  unsigned long getBaudRate() const;
+
+  // Checks whether a rate may be requested.
+  //
+  // baud: The rate to check [bits/s].
+  // Returns: True if the rate is supported.
+  static bool isSupported(unsigned long baud);
+
+ private:
+  // Rates the host may request [bits/s]. All are reachable within 2.1% on a
+  // 16 MHz ATmega328; 230400 is not, at -3.5%.
+  static const uint8_t NUM_SUPPORTED_BAUD_RATES = 7u;
+  static const unsigned long SUPPORTED_BAUD_RATES[NUM_SUPPORTED_BAUD_RATES];
+
+  // Reopens the port at a given rate.
+  //
+  // baud: The rate to open the port at [bits/s].
+  void reopen(unsigned long baud);
+
+  // The serial port to manage.
+  HardwareSerial* const serial_;
+
+  // Time the host has to confirm a new rate [ms].
+  const unsigned long confirm_timeout_ms_;
+
+  // Rate the port is open at, and the last rate known to work [bits/s].
+  unsigned long baud_;
+  unsigned long confirmed_baud_;
+
+  // Rate requested by the host [bits/s].
+  unsigned long requested_baud_;
+
+  // Stage of any rate change in progress.
+  State state_;
+
+  // Time at which the port was reopened at the requested rate [ms].
+  unsigned long switched_ms_;
+
+  // Transmit buffer space reported by the port when it has nothing to send.
+  int idle_tx_room_;
+};
+
+#endif
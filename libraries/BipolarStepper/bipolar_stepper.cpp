@@ -1,29 +1,65 @@
 #include "bipolar_stepper.h"
 #include <Arduino.h>
 
+// Lines written by each half-step state, and the levels they are driven to, as
+// bit masks over Line. Lines a state doesn't write keep their last level. Even
+// states energize a single coil and are the full-step sequence; odd states
+// energize both coils.
+const uint8_t BipolarStepper::STATE_LINES_WRITTEN[NUM_HALF_STATES] = {
+  (1u << BRKA) | (1u << BRKB) | (1u << DIRA) | (1u << PWMA),
+  (1u << BRKA) | (1u << BRKB) | (1u << DIRA) | (1u << PWMA) | (1u << DIRB) |
+      (1u << PWMB),
+  (1u << BRKA) | (1u << BRKB) | (1u << DIRB) | (1u << PWMB),
+  (1u << BRKA) | (1u << BRKB) | (1u << DIRA) | (1u << PWMA) | (1u << DIRB) |
+      (1u << PWMB),
+  (1u << BRKA) | (1u << BRKB) | (1u << DIRA) | (1u << PWMA),
+  (1u << BRKA) | (1u << BRKB) | (1u << DIRA) | (1u << PWMA) | (1u << DIRB) |
+      (1u << PWMB),
+  (1u << BRKA) | (1u << BRKB) | (1u << DIRB) | (1u << PWMB),
+  (1u << BRKA) | (1u << BRKB) | (1u << DIRA) | (1u << PWMA) | (1u << DIRB) |
+      (1u << PWMB)
+};
+const uint8_t BipolarStepper::STATE_LINES_HIGH[NUM_HALF_STATES] = {
+  (1u << BRKB) | (1u << DIRA) | (1u << PWMA),
+  (1u << DIRA) | (1u << PWMA) | (1u << PWMB),
+  (1u << BRKA) | (1u << PWMB),
+  (1u << PWMA) | (1u << PWMB),
+  (1u << BRKB) | (1u << PWMA),
+  (1u << PWMA) | (1u << DIRB) | (1u << PWMB),
+  (1u << BRKA) | (1u << DIRB) | (1u << PWMB),
+  (1u << DIRA) | (1u << PWMA) | (1u << DIRB) | (1u << PWMB)
+};
+
+const uint8_t BipolarStepper::QUARTER_SINE[MICROSTEPS_PER_STEP + 1] = {
+  0u, 50u, 98u, 142u, 180u, 212u, 236u, 250u, 255u
+};
+
 BipolarStepper::BipolarStepper(int brka, int dira, int pwma, int brkb, int dirb,
-    int pwmb) : brka_(brka), dira_(dira), pwma_(pwma), brkb_(brkb), dirb_(dirb),
-    pwmb_(pwmb), state_(0), initialized_(false), enabled_(false) {}
+    int pwmb) : pins_{brka, dira, pwma, brkb, dirb, pwmb}, phase_(0),
+    step_mode_(StepMode::FULL_STEP), initialized_(false), enabled_(false) {}
 
 BipolarStepper::~BipolarStepper() {
   // Put our outputs in what should be a safe state before destroying the object
   // that controls them.
-  digitalWrite(brka_, LOW);
-  digitalWrite(dira_, LOW);
-  digitalWrite(pwma_, LOW);
-  digitalWrite(brkb_, LOW);
-  digitalWrite(dirb_, LOW);
-  digitalWrite(pwmb_, LOW);
+  for (int line = 0; line < NUM_LINES; ++line) {
+    digitalWrite(pins_[line], LOW);
+  }
 }
 
 void BipolarStepper::initialize() {
-  pinMode(brka_, OUTPUT);
-  pinMode(dira_, OUTPUT);
-  pinMode(pwma_, OUTPUT);
-  pinMode(brkb_, OUTPUT);
-  pinMode(dirb_, OUTPUT);
-  pinMode(pwmb_, OUTPUT);
-  doState(state_);
+  for (int line = 0; line < NUM_LINES; ++line) {
+    pinMode(pins_[line], OUTPUT);
+    // Besides setting a known level, this disconnects any PWM timer from the
+    // pin so that writing its port register directly takes effect.
+    digitalWrite(pins_[line], LOW);
+  }
+#if defined(__AVR__)
+  resolvePorts();
+#endif
+  if (step_mode_ == StepMode::MICROSTEP) {
+    attachPwm(true);
+  }
+  doState(phase_);
   initialized_ = true;
 }
 
@@ -48,8 +84,9 @@ void BipolarStepper::stepForward() {
     return;
   }
 
-  state_ = (state_ + 1) % NUM_STATES;
-  doState(state_);
+  const int stride = MICROSTEPS_PER_STEP / getStepsPerFullStep();
+  phase_ = (phase_ + stride) % NUM_PHASES;
+  doState(phase_);
 }
 
 void BipolarStepper::stepBackward() {
@@ -57,39 +94,234 @@ void BipolarStepper::stepBackward() {
     return;
   }
 
-  state_ = (state_ + NUM_STATES - 1) % NUM_STATES;
-  doState(state_);
+  const int stride = MICROSTEPS_PER_STEP / getStepsPerFullStep();
+  phase_ = (phase_ + NUM_PHASES - stride) % NUM_PHASES;
+  doState(phase_);
+}
+
+void BipolarStepper::setStepMode(const StepMode step_mode) {
+  if (step_mode == step_mode_) {
+    return;
+  }
+
+  const bool was_microstepping = step_mode_ == StepMode::MICROSTEP;
+  step_mode_ = step_mode;
+  const int stride = MICROSTEPS_PER_STEP / getStepsPerFullStep();
+  phase_ = ((phase_ + stride / 2) / stride * stride) % NUM_PHASES;
+  if (!initialized_) {
+    return;
+  }
+
+  if (was_microstepping != (step_mode_ == StepMode::MICROSTEP)) {
+    attachPwm(!was_microstepping);
+  }
+  doState(phase_);
 }
 
-void BipolarStepper::doState(int state) {
-  state %= 4;
-  switch (state) {
+BipolarStepper::StepMode BipolarStepper::getStepMode() const {
+  return step_mode_;
+}
+
+int BipolarStepper::getStepsPerFullStep() const {
+  switch (step_mode_) {
+    default:
+    case StepMode::FULL_STEP:
+      return 1;
+    case StepMode::HALF_STEP:
+      return 2;
+    case StepMode::MICROSTEP:
+      return MICROSTEPS_PER_STEP;
+  }
+}
+
+int BipolarStepper::getPhase() const {
+  return phase_;
+}
+
+bool BipolarStepper::setPhase(const int phase) {
+  const int stride = MICROSTEPS_PER_STEP / getStepsPerFullStep();
+  if (initialized_ || phase < 0 || phase >= NUM_PHASES ||
+      phase % stride != 0) {
+    return false;
+  }
+  phase_ = phase;
+  return true;
+}
+
+#if defined(__AVR__)
+void BipolarStepper::resolvePorts() {
+  fast_io_ = true;
+  num_ports_ = 0u;
+  for (int line = 0; line < NUM_LINES; ++line) {
+    volatile uint8_t* const port =
+        portOutputRegister(digitalPinToPort(pins_[line]));
+    uint8_t index = 0u;
+    while (index < num_ports_ && ports_[index] != port) {
+      ++index;
+    }
+    if (port == nullptr || (index == num_ports_ && num_ports_ == MAX_PORTS)) {
+      fast_io_ = false;
+      return;
+    }
+    if (index == num_ports_) {
+      ports_[num_ports_++] = port;
+    }
+    line_ports_[line] = index;
+    line_bits_[line] = digitalPinToBitMask(pins_[line]);
+  }
+
+  for (int state = 0; state < NUM_HALF_STATES; ++state) {
+    for (uint8_t index = 0u; index < num_ports_; ++index) {
+      clear_masks_[state][index] = 0u;
+      set_masks_[state][index] = 0u;
+    }
+    for (int line = 0; line < NUM_LINES; ++line) {
+      if (STATE_LINES_WRITTEN[state] & (1u << line)) {
+        clear_masks_[state][line_ports_[line]] |= line_bits_[line];
+        if (STATE_LINES_HIGH[state] & (1u << line)) {
+          set_masks_[state][line_ports_[line]] |= line_bits_[line];
+        }
+      }
+    }
+  }
+
+  const Line pwm_lines[2] = {PWMA, PWMB};
+  for (int i = 0; i < 2; ++i) {
+    switch (digitalPinToTimer(pins_[pwm_lines[i]])) {
+#if defined(OCR0A)
+      case TIMER0A: duty_registers_[i] = &OCR0A; break;
+#endif
+#if defined(OCR0B)
+      case TIMER0B: duty_registers_[i] = &OCR0B; break;
+#endif
+#if defined(OCR2A)
+      case TIMER2A: duty_registers_[i] = &OCR2A; break;
+#endif
+#if defined(OCR2B)
+      case TIMER2B: duty_registers_[i] = &OCR2B; break;
+#endif
+      default: duty_registers_[i] = nullptr; break;
+    }
+  }
+}
+#endif
+
+void BipolarStepper::doState(int phase) {
+  phase %= NUM_PHASES;
+  if (step_mode_ != StepMode::MICROSTEP) {
+    const int state = phase / (NUM_PHASES / NUM_HALF_STATES);
+#if defined(__AVR__)
+    if (fast_io_) {
+      // One read-modify-write per port, with interrupts held off so that a
+      // pin change elsewhere on the same port can't be lost mid-update.
+      const uint8_t sreg = SREG;
+      cli();
+      for (uint8_t index = 0u; index < num_ports_; ++index) {
+        *ports_[index] = (*ports_[index] & ~clear_masks_[state][index]) |
+            set_masks_[state][index];
+      }
+      SREG = sreg;
+      return;
+    }
+#endif
+    writeLines(STATE_LINES_WRITTEN[state], STATE_LINES_HIGH[state]);
+    return;
+  }
+
+  // Coil A carries the cosine of the phase and coil B the sine. A positive
+  // current corresponds to DIRA high and DIRB low, matching the full-step
+  // sequence.
+  const int16_t current_a = sine(phase + NUM_PHASES / 4);
+  const int16_t current_b = sine(phase);
+  const uint8_t lines_high = (current_a >= 0 ? (1u << DIRA) : 0u) |
+      (current_b < 0 ? (1u << DIRB) : 0u);
+  writeLines((1u << BRKA) | (1u << BRKB) | (1u << DIRA) | (1u << DIRB),
+      lines_high);
+  writeDuty(PWMA, current_a >= 0 ? current_a : -current_a);
+  writeDuty(PWMB, current_b >= 0 ? current_b : -current_b);
+}
+
+void BipolarStepper::writeLines(const uint8_t lines_written,
+    const uint8_t lines_high) {
+#if defined(__AVR__)
+  if (fast_io_) {
+    uint8_t clear_masks[MAX_PORTS] = {0u};
+    uint8_t set_masks[MAX_PORTS] = {0u};
+    for (int line = 0; line < NUM_LINES; ++line) {
+      if (lines_written & (1u << line)) {
+        clear_masks[line_ports_[line]] |= line_bits_[line];
+        if (lines_high & (1u << line)) {
+          set_masks[line_ports_[line]] |= line_bits_[line];
+        }
+      }
+    }
+    const uint8_t sreg = SREG;
+    cli();
+    for (uint8_t index = 0u; index < num_ports_; ++index) {
+      *ports_[index] = (*ports_[index] & ~clear_masks[index]) |
+          set_masks[index];
+    }
+    SREG = sreg;
+    return;
+  }
+#endif
+  for (int line = 0; line < NUM_LINES; ++line) {
+    if (lines_written & (1u << line)) {
+      digitalWrite(pins_[line], (lines_high & (1u << line)) ? HIGH : LOW);
+    }
+  }
+}
+
+void BipolarStepper::writeDuty(const Line line, const uint8_t duty) {
+#if defined(__AVR__)
+  volatile uint8_t* const duty_register =
+      duty_registers_[line == PWMA ? 0 : 1];
+  if (duty_register != nullptr) {
+    *duty_register = duty;
+    return;
+  }
+#endif
+  analogWrite(pins_[line], duty);
+}
+
+void BipolarStepper::attachPwm(const bool attach) {
+  if (attach) {
+    // Any duty strictly between 0 and 255 makes analogWrite() connect the
+    // compare output; the real duty is written by doState() straight after.
+    analogWrite(pins_[PWMA], 1);
+    analogWrite(pins_[PWMB], 1);
+  } else {
+    digitalWrite(pins_[PWMA], LOW);
+    digitalWrite(pins_[PWMB], LOW);
+  }
+
+#if defined(__AVR__) && defined(TCCR2B) && defined(TIMER2A) && defined(TIMER2B)
+  // Timer2's default ~490 Hz carrier is audible and lets coil current ripple
+  // heavily, so run it unscaled (~31 kHz) while microstepping, restoring the
+  // Arduino core's prescaler of 64 afterward. Timer2 is otherwise unused here.
+  const uint8_t timer_a = digitalPinToTimer(pins_[PWMA]);
+  const uint8_t timer_b = digitalPinToTimer(pins_[PWMB]);
+  if (timer_a == TIMER2A || timer_a == TIMER2B || timer_b == TIMER2A ||
+      timer_b == TIMER2B) {
+    const uint8_t prescaler_bits = attach ? _BV(CS20) : _BV(CS22);
+    TCCR2B = (TCCR2B & ~(_BV(CS22) | _BV(CS21) | _BV(CS20))) | prescaler_bits;
+  }
+#endif
+}
+
+int16_t BipolarStepper::sine(int phase) {
+  phase %= NUM_PHASES;
+  const int quarter = phase / MICROSTEPS_PER_STEP;
+  const int offset = phase % MICROSTEPS_PER_STEP;
+  switch (quarter) {
+    default:
     case 0:
-      digitalWrite(brka_, LOW);
-      digitalWrite(brkb_, HIGH);
-      digitalWrite(dira_, HIGH);
-      analogWrite(pwma_, 255);
-      break;
+      return QUARTER_SINE[offset];
     case 1:
-      digitalWrite(brka_, HIGH);
-      digitalWrite(brkb_, LOW);
-      digitalWrite(dirb_, LOW);
-      analogWrite(pwmb_, 255);
-      break;
+      return QUARTER_SINE[MICROSTEPS_PER_STEP - offset];
     case 2:
-      digitalWrite(brka_, LOW);
-      digitalWrite(brkb_, HIGH);
-      digitalWrite(dira_, LOW);
-      analogWrite(pwma_, 255);
-      break;
+      return -QUARTER_SINE[offset];
     case 3:
-      digitalWrite(brka_, HIGH);
-      digitalWrite(brkb_, LOW);
-      digitalWrite(dirb_, HIGH);
-      analogWrite(pwmb_, 255);
-      break;
-    default:
-      // Can't get here.
-      break;
+      return -QUARTER_SINE[MICROSTEPS_PER_STEP - offset];
   }
 }
@@ -1,9 +1,21 @@
 #ifndef BIPOLAR_STEPPER_H_
 #define BIPOLAR_STEPPER_H_
 
+#include <Arduino.h>  // For uint8_t
+
 // Represents a bipolar stepper motor.
 class BipolarStepper {
  public:
+  // Ways of dividing each full step of the motor.
+  enum class StepMode : int {
+    FULL_STEP = 0,  // One coil energized at a time. Default value.
+    HALF_STEP,      // Alternates between one and both coils energized.
+    MICROSTEP       // Coil currents weighted by sine and cosine via PWM.
+  };
+
+  // Number of steps per full step in MICROSTEP mode.
+  static const int MICROSTEPS_PER_STEP = 8;
+
   // Constructs a BipolarStepper by denoting Arduino pins to be used for motor
   // functions. The object will be created in an uninitialized, disabled state.
   //
@@ -17,7 +29,9 @@ class BipolarStepper {
   ~BipolarStepper();
 
   // Initializes a BipolarStepper object. This must be called in order for
-  // actuation commands to function properly.
+  // actuation commands to function properly. On AVR targets, this also
+  // resolves each pin to its port register and bit so that steps can be
+  // issued with direct port writes.
   void initialize();
 
   // Checks whether the BipolarStepper object has been initialized.
@@ -46,26 +60,138 @@ class BipolarStepper {
   // initialized and enabled.
   void stepBackward();
 
+  // Selects how finely each full step of the motor is divided. If the motor is
+  // between positions of the new mode, it is moved to the nearest one.
+  //
+  // step_mode: The step mode to use from now on.
+  void setStepMode(StepMode step_mode);
+
+  // Retrieves the active step mode.
+  //
+  // Returns: The active step mode.
+  StepMode getStepMode() const;
+
+  // Retrieves the number of steps that make up one full step of the motor in
+  // the active step mode.
+  //
+  // Returns: 1 for full steps, 2 for half steps, or MICROSTEPS_PER_STEP.
+  int getStepsPerFullStep() const;
+
+  // Retrieves the active phase of the motor's electrical cycle.
+  //
+  // Returns: The phase [microsteps], between 0 and 4 * MICROSTEPS_PER_STEP - 1.
+  int getPhase() const;
+
+  // Selects the phase initialize() energizes, so that a rotor left at rest in
+  // that phase doesn't jump when the coils are first driven.
+  //
+  // phase: The phase [microsteps], as returned by getPhase().
+  // Returns: True if the phase was set, or false if the motor is already
+  //          initialized or the phase isn't a position of the active step
+  //          mode.
+  bool setPhase(int phase);
+
  private:
-  // The number of unique states that are cycled through via the stepForward()
-  // and stepBackward() functions.
-  static const int NUM_STATES = 4;
-
-  // Internal function that executes a particular motor state by energizing pins
-  // in a pattern appropriate for the current state.
-  void doState(int state);
-
-  // Arduino pin assignments for motor functions.
-  const int brka_;
-  const int dira_;
-  const int pwma_;
-  const int brkb_;
-  const int dirb_;
-  const int pwmb_;
-
-  // Which energization state is currently active. Normally between 0 and
-  // (NUM_STATES - 1).
-  int state_;
+  // The number of finest-resolution phases in one electrical cycle of the
+  // motor (four full steps).
+  static const int NUM_PHASES = 4 * MICROSTEPS_PER_STEP;
+
+  // The number of half-step states in one electrical cycle. Full steps use
+  // every other one.
+  static const int NUM_HALF_STATES = 8;
+
+  // Most distinct I/O ports the motor pins can occupy while still being driven
+  // with direct port writes.
+  static const uint8_t MAX_PORTS = 3u;
+
+  // Motor lines, used to index pins_ and the state tables.
+  enum Line : int {
+    BRKA = 0,
+    DIRA,
+    PWMA,
+    BRKB,
+    DIRB,
+    PWMB,
+    NUM_LINES
+  };
+
+  // For each half-step state, bit masks over Line of the lines the state
+  // drives and of those it drives high.
+  static const uint8_t STATE_LINES_WRITTEN[NUM_HALF_STATES];
+  static const uint8_t STATE_LINES_HIGH[NUM_HALF_STATES];
+
+  // Sine of each microstep phase within the first quarter cycle, inclusive of
+  // both ends, scaled to full PWM duty.
+  static const uint8_t QUARTER_SINE[MICROSTEPS_PER_STEP + 1];
+
+  // Internal function that executes a particular motor phase by energizing pins
+  // in a pattern appropriate for the current step mode.
+  //
+  // phase: The phase to execute, in units of microsteps.
+  void doState(int phase);
+
+  // Drives a subset of the motor's digital lines.
+  //
+  // lines_written: Bit mask over Line of the lines to drive.
+  // lines_high: Bit mask over Line of the lines to drive high; the rest of
+  //             lines_written are driven low.
+  void writeLines(uint8_t lines_written, uint8_t lines_high);
+
+  // Sets the PWM duty of one of the coil enable lines.
+  //
+  // line: PWMA or PWMB.
+  // duty: Duty cycle, where 255 is fully on.
+  void writeDuty(Line line, uint8_t duty);
+
+  // Connects or disconnects the PWM timers driving the coil enable lines.
+  // Microstepping needs them connected; the other modes treat the enable lines
+  // as plain digital outputs.
+  //
+  // attach: True to connect the timers.
+  void attachPwm(bool attach);
+
+  // Computes the sine of a microstep phase.
+  //
+  // phase: The phase [microsteps]; one electrical cycle is NUM_PHASES.
+  // Returns: The sine of the phase, scaled to the range [-255, 255].
+  static int16_t sine(int phase);
+
+  // Arduino pin assignments for motor functions, indexed by Line.
+  const int pins_[NUM_LINES];
+
+#if defined(__AVR__)
+  // Looks up the output port register and bit of every motor pin, and the
+  // compare register behind each PWM pin, then precomputes the masks each
+  // half-step state applies to each port.
+  void resolvePorts();
+
+  // Whether the motor pins could be resolved to at most MAX_PORTS ports. If
+  // not, lines are driven with digitalWrite().
+  bool fast_io_;
+
+  // Distinct output port registers used by the motor pins.
+  volatile uint8_t* ports_[MAX_PORTS];
+  uint8_t num_ports_;
+
+  // Index into ports_ and bit within that port of each line.
+  uint8_t line_ports_[NUM_LINES];
+  uint8_t line_bits_[NUM_LINES];
+
+  // Per half-step state and per port: bits to clear, then bits to set.
+  uint8_t clear_masks_[NUM_HALF_STATES][MAX_PORTS];
+  uint8_t set_masks_[NUM_HALF_STATES][MAX_PORTS];
+
+  // 8-bit output compare registers behind PWMA and PWMB, or nullptr to fall
+  // back on analogWrite().
+  volatile uint8_t* duty_registers_[2];
+#endif
+
+  // Which microstep phase is currently active. Normally between 0 and
+  // (NUM_PHASES - 1), and a multiple of the active mode's phase stride.
+  int phase_;
+
+  // Active step mode.
+  StepMode step_mode_;
 
   // Other status variables.
   bool initialized_;
@@ -0,0 +1,274 @@
+#include "command_parser.h"
+
+CommandParser::CommandParser(bool (*const takes_args)(char code),
+    const unsigned long idle_timeout_ms) : takes_args_(takes_args),
+    idle_timeout_ms_(idle_timeout_ms), building_(), state_(State::IDLE),
+    arg_started_(false), arg_negative_(false), discarding_args_(false),
+    last_byte_ms_(0u), ready_(), has_ready_(false), frame_(),
+    frame_length_(0u), frame_received_(0u), frame_crc_(CRC_INITIAL),
+    frame_crc_low_(0u), frame_cursor_(0u), frame_end_(0u),
+    frame_errors_(0u) {}
+
+void CommandParser::feed(const char c, const unsigned long now_ms) {
+  switch (state_) {
+    default:
+    case State::IDLE:
+    case State::COMPLETE:
+      // Line endings between commands carry no meaning.
+      if (c != '\r' && c != '\n') {
+        if (state_ == State::COMPLETE) {
+          finish();
+        }
+        begin(c, now_ms);
+      }
+      break;
+    case State::ARGS:
+      last_byte_ms_ = now_ms;
+      if (isDigit(c)) {
+        if (!discarding_args_) {
+          accumulateDigit(c - '0');
+        }
+        arg_started_ = true;
+      } else if (c == '-' && !arg_started_) {
+        arg_negative_ = true;
+        arg_started_ = true;
+      } else if (c == ',') {
+        // Arguments beyond MAX_ARGS are parsed but dropped.
+        if (building_.num_args < MAX_ARGS) {
+          building_.num_args++;
+        } else {
+          discarding_args_ = true;
+        }
+        arg_started_ = false;
+        arg_negative_ = false;
+      } else if (c == ' ') {
+        // Spaces are skipped.
+      } else if (c == '\r' || c == '\n') {
+        finish();
+      } else {
+        // Anything else starts the next command.
+        finish();
+        begin(c, now_ms);
+      }
+      break;
+    case State::FRAME_LENGTH:
+    case State::FRAME_BODY:
+    case State::FRAME_CRC_LOW:
+    case State::FRAME_CRC_HIGH:
+      last_byte_ms_ = now_ms;
+      feedFrame(static_cast<uint8_t>(c));
+      break;
+  }
+}
+
+bool CommandParser::next(Command* const command, const unsigned long now_ms) {
+  if (!has_ready_ && nextFramed(command)) {
+    return true;
+  }
+
+  const bool timed_out = now_ms - last_byte_ms_ >= idle_timeout_ms_;
+  if (!has_ready_ && state_ == State::ARGS && timed_out) {
+    finish();
+  }
+  if (!has_ready_ && state_ == State::COMPLETE) {
+    finish();
+  }
+  if (timed_out && (state_ == State::FRAME_LENGTH ||
+      state_ == State::FRAME_BODY || state_ == State::FRAME_CRC_LOW ||
+      state_ == State::FRAME_CRC_HIGH)) {
+    discardFrame();
+  }
+  if (!has_ready_) {
+    return false;
+  }
+  *command = ready_;
+  has_ready_ = false;
+  return true;
+}
+
+void CommandParser::reset() {
+  state_ = State::IDLE;
+  has_ready_ = false;
+  frame_cursor_ = frame_end_;
+}
+
+uint16_t CommandParser::getFrameErrorCount() const {
+  return frame_errors_;
+}
+
+void CommandParser::writeFrame(Print& out, const char code,
+    const int32_t* const args, const uint8_t num_args) {
+  const uint8_t count =
+      num_args < MAX_FRAME_VALUES ? num_args : MAX_FRAME_VALUES;
+  const uint8_t length = 1u + 4u * count;
+  uint16_t crc = updateCrc(CRC_INITIAL, length);
+  crc = updateCrc(crc, static_cast<uint8_t>(code));
+  out.write(SYNC_BYTE);
+  out.write(length);
+  out.write(static_cast<uint8_t>(code));
+  for (uint8_t i = 0u; i < count; ++i) {
+    const uint32_t arg = static_cast<uint32_t>(args[i]);
+    for (uint8_t shift = 0u; shift < 32u; shift += 8u) {
+      const uint8_t c = static_cast<uint8_t>(arg >> shift);
+      crc = updateCrc(crc, c);
+      out.write(c);
+    }
+  }
+  out.write(static_cast<uint8_t>(crc));
+  out.write(static_cast<uint8_t>(crc >> 8));
+}
+
+void CommandParser::begin(const char c, const unsigned long now_ms) {
+  last_byte_ms_ = now_ms;
+  if (static_cast<uint8_t>(c) == SYNC_BYTE) {
+    state_ = State::FRAME_LENGTH;
+    return;
+  }
+
+  building_.code = c;
+  building_.num_args = 0u;
+  for (uint8_t i = 0u; i < MAX_ARGS; ++i) {
+    building_.args[i] = 0;
+  }
+  building_.framed = false;
+  arg_started_ = false;
+  arg_negative_ = false;
+  discarding_args_ = false;
+  if (takes_args_ != nullptr && takes_args_(c)) {
+    // Count the first argument from the outset; trailing empty arguments are
+    // trimmed in finish().
+    building_.num_args = 1u;
+    state_ = State::ARGS;
+  } else {
+    state_ = State::COMPLETE;
+  }
+}
+
+void CommandParser::finish() {
+  if (state_ == State::ARGS && !arg_started_ && !discarding_args_) {
+    building_.num_args--;
+  }
+  ready_ = building_;
+  has_ready_ = true;
+  state_ = State::IDLE;
+}
+
+void CommandParser::feedFrame(const uint8_t c) {
+  switch (state_) {
+    default:
+      break;
+    case State::FRAME_LENGTH:
+      if (c == 0u || c > MAX_FRAME_LENGTH) {
+        discardFrame();
+        break;
+      }
+      frame_length_ = c;
+      frame_received_ = 0u;
+      frame_crc_ = updateCrc(CRC_INITIAL, c);
+      state_ = State::FRAME_BODY;
+      break;
+    case State::FRAME_BODY:
+      frame_[frame_received_++] = c;
+      frame_crc_ = updateCrc(frame_crc_, c);
+      if (frame_received_ == frame_length_) {
+        state_ = State::FRAME_CRC_LOW;
+      }
+      break;
+    case State::FRAME_CRC_LOW:
+      frame_crc_low_ = c;
+      state_ = State::FRAME_CRC_HIGH;
+      break;
+    case State::FRAME_CRC_HIGH:
+      if ((frame_crc_low_ | (static_cast<uint16_t>(c) << 8)) != frame_crc_) {
+        discardFrame();
+        break;
+      }
+      // Hand the frame's commands to next(), skipping the batch marker.
+      frame_cursor_ = static_cast<char>(frame_[0]) == BATCH_CODE ? 1u : 0u;
+      frame_end_ = frame_length_;
+      state_ = State::IDLE;
+      break;
+  }
+}
+
+bool CommandParser::nextFramed(Command* const command) {
+  const bool batch = static_cast<char>(frame_[0]) == BATCH_CODE;
+  while (frame_cursor_ < frame_end_) {
+    if (!batch) {
+      frame_cursor_ = frame_end_;
+      if (decode(frame_, frame_end_, command)) {
+        return true;
+      }
+      countFrameError();
+      return false;
+    }
+
+    const uint8_t length = frame_[frame_cursor_];
+    const uint8_t start = frame_cursor_ + 1u;
+    if (length == 0u || length > frame_end_ - start) {
+      // The rest of the batch can't be delimited.
+      frame_cursor_ = frame_end_;
+      countFrameError();
+      return false;
+    }
+    frame_cursor_ = start + length;
+    if (decode(&frame_[start], length, command)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CommandParser::decode(const uint8_t* const body, const uint8_t length,
+    Command* const command) {
+  const uint8_t payload = length - 1u;
+  if (payload % 4u != 0u || payload / 4u > MAX_ARGS) {
+    return false;
+  }
+  command->code = static_cast<char>(body[0]);
+  command->num_args = payload / 4u;
+  command->framed = true;
+  for (uint8_t i = 0u; i < MAX_ARGS; ++i) {
+    uint32_t arg = 0u;
+    if (i < command->num_args) {
+      const uint8_t* const bytes = &body[1u + 4u * i];
+      arg = static_cast<uint32_t>(bytes[0]) |
+          static_cast<uint32_t>(bytes[1]) << 8 |
+          static_cast<uint32_t>(bytes[2]) << 16 |
+          static_cast<uint32_t>(bytes[3]) << 24;
+    }
+    command->args[i] = static_cast<int32_t>(arg);
+  }
+  return true;
+}
+
+void CommandParser::discardFrame() {
+  countFrameError();
+  state_ = State::IDLE;
+}
+
+void CommandParser::countFrameError() {
+  frame_errors_ = frame_errors_ < 0xFFFFu ? frame_errors_ + 1u : 0xFFFFu;
+}
+
+uint16_t CommandParser::updateCrc(uint16_t crc, const uint8_t c) {
+  crc ^= static_cast<uint16_t>(c) << 8;
+  for (uint8_t bit = 0u; bit < 8u; ++bit) {
+    crc = (crc & 0x8000u) ? (crc << 1) ^ 0x1021u : crc << 1;
+  }
+  return crc;
+}
+
+void CommandParser::accumulateDigit(const int32_t digit) {
+  // Saturate rather than overflow on absurdly long numbers.
+  int32_t& arg = building_.args[building_.num_args - 1u];
+  if (arg_negative_) {
+    arg = arg < (MIN_ARG + digit) / 10 ? MIN_ARG : arg * 10 - digit;
+  } else {
+    arg = arg > (MAX_ARG - digit) / 10 ? MAX_ARG : arg * 10 + digit;
+  }
+}
+
+bool CommandParser::isDigit(const char c) {
+  return c >= '0' && c <= '9';
+}
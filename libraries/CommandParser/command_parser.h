@@ -0,0 +1,206 @@
+#ifndef COMMAND_PARSER_H_
+#define COMMAND_PARSER_H_
+
+#include <Arduino.h>  // For int32_t, uint8_t
+
+// Assembles serial commands one byte at a time so that reading them never
+// blocks. Two encodings may be mixed freely on the same stream:
+//
+// ASCII: A command is a single character, optionally followed by up to
+// MAX_ARGS integer arguments separated by commas, e.g. "q9000,500". A command
+// with arguments is complete once it is followed by a line ending, by the
+// character of the next command, or by a pause in input longer than the idle
+// timeout.
+//
+// Binary: A frame consists of SYNC_BYTE, a length byte, a body of that many
+// bytes, and a CRC-16/CCITT of the length and body, sent low byte first. The
+// body is the command character followed by its arguments as 32-bit
+// little-endian integers. A body starting with BATCH_CODE instead holds a run
+// of commands, each prefixed by its own length byte. Frames that are
+// malformed, fail their CRC or stall for longer than the idle timeout are
+// discarded and counted.
+class CommandParser {
+ public:
+  // Largest number of arguments a command may carry.
+  static const uint8_t MAX_ARGS = 6u;
+
+  // First byte of every binary frame. Never a valid ASCII command.
+  static const uint8_t SYNC_BYTE = 0xA5u;
+
+  // Command character introducing a batch of commands in one binary frame.
+  static const char BATCH_CODE = '*';
+
+  // Longest binary frame body [bytes].
+  static const uint8_t MAX_FRAME_LENGTH = 64u;
+
+  // Most values writeFrame() can fit in one frame.
+  static const uint8_t MAX_FRAME_VALUES = (MAX_FRAME_LENGTH - 1u) / 4u;
+
+  // A complete command.
+  struct Command {
+    char code;               // Command character.
+    uint8_t num_args;        // Number of arguments actually received.
+    int32_t args[MAX_ARGS];  // Arguments; zero where none were received.
+    bool framed;             // Whether the command arrived in a binary frame.
+  };
+
+  // Constructs a CommandParser.
+  //
+  // takes_args: Function reporting whether a command character is followed
+  //             by arguments. Other commands are complete as soon as their
+  //             character arrives.
+  //  -> code: The command character.
+  // idle_timeout_ms: Time without input after which a command awaiting
+  //                  arguments is considered complete [ms].
+  CommandParser(bool (*takes_args)(char code), unsigned long idle_timeout_ms);
+
+  // Consumes one byte of input. Every command completed by feed() must be
+  // collected by calling next() until it returns false before feeding the
+  // following byte.
+  //
+  // c: The byte received.
+  // now_ms: The current time, as from millis() [ms].
+  void feed(char c, unsigned long now_ms);
+
+  // Retrieves the next complete command, if any.
+  //
+  // command: Where to store the command.
+  // now_ms: The current time, as from millis() [ms].
+  // Returns: True if a command was stored, or false if none is complete yet.
+  bool next(Command* command, unsigned long now_ms);
+
+  // Discards any partially received or uncollected commands.
+  void reset();
+
+  // Retrieves the number of binary frames discarded as malformed, corrupt or
+  // incomplete.
+  //
+  // Returns: Discarded frame count. Saturates rather than wrapping.
+  uint16_t getFrameErrorCount() const;
+
+  // Writes a command or response as a binary frame.
+  //
+  // out: Where to write the frame.
+  // code: The command or response character.
+  // args: The values to send. May be nullptr if num_args is zero.
+  // num_args: Number of values, at most MAX_FRAME_VALUES. Commands sent to a
+  //           CommandParser should carry no more than MAX_ARGS.
+  static void writeFrame(Print& out, char code, const int32_t* args,
+      uint8_t num_args);
+
+ private:
+  // Range of argument values; longer numbers saturate.
+  static const int32_t MAX_ARG = 2147483647L;
+  static const int32_t MIN_ARG = -MAX_ARG - 1;
+
+  // Progress through the command being assembled.
+  enum class State : int {
+    IDLE = 0,        // Waiting for a command character. Default value.
+    ARGS,            // Accumulating ASCII arguments.
+    COMPLETE,        // Command is complete and waiting to be collected.
+    FRAME_LENGTH,    // Waiting for the length byte of a binary frame.
+    FRAME_BODY,      // Accumulating the body of a binary frame.
+    FRAME_CRC_LOW,   // Waiting for the low byte of the frame's CRC.
+    FRAME_CRC_HIGH   // Waiting for the high byte of the frame's CRC.
+  };
+
+  // Value the CRC of each frame starts from.
+  static const uint16_t CRC_INITIAL = 0xFFFFu;
+
+  // Begins assembling a command.
+  //
+  // c: The command character.
+  // now_ms: The current time [ms].
+  void begin(char c, unsigned long now_ms);
+
+  // Marks the command being assembled as complete, moving it into the ready
+  // slot so that a new command can begin behind it.
+  void finish();
+
+  // Handles one byte belonging to a binary frame.
+  //
+  // c: The byte received.
+  void feedFrame(uint8_t c);
+
+  // Extracts the next command from a received binary frame, skipping over
+  // malformed batch entries.
+  //
+  // command: Where to store the command.
+  // Returns: True if a command was stored, or false if the frame is used up.
+  bool nextFramed(Command* command);
+
+  // Decodes a frame body or batch entry into a command.
+  //
+  // body: The command character and its little-endian arguments.
+  // length: Length of body [bytes].
+  // command: Where to store the command.
+  // Returns: True if the body was well formed.
+  static bool decode(const uint8_t* body, uint8_t length, Command* command);
+
+  // Counts a discarded frame and returns to waiting for commands.
+  void discardFrame();
+
+  // Counts a malformed frame or batch entry.
+  void countFrameError();
+
+  // Folds one byte into a CRC-16/CCITT.
+  //
+  // crc: The CRC so far.
+  // c: The byte to fold in.
+  // Returns: The updated CRC.
+  static uint16_t updateCrc(uint16_t crc, uint8_t c);
+
+  // Appends a decimal digit to the argument being accumulated.
+  //
+  // digit: The value of the digit, 0 through 9.
+  void accumulateDigit(int32_t digit);
+
+  // Determines whether a byte is a decimal digit.
+  //
+  // c: The byte to check.
+  // Returns: True if c is one of '0' through '9'.
+  static bool isDigit(char c);
+
+  // Function reporting whether a command takes arguments.
+  bool (*const takes_args_)(char code);
+
+  // Time without input after which arguments are considered complete [ms].
+  const unsigned long idle_timeout_ms_;
+
+  // Command being assembled and its progress.
+  Command building_;
+  State state_;
+
+  // Whether the argument being accumulated has received a digit or minus sign
+  // yet, and whether it is negative.
+  bool arg_started_;
+  bool arg_negative_;
+
+  // Whether more arguments have arrived than there is room for.
+  bool discarding_args_;
+
+  // Time at which the last byte of the command being assembled arrived [ms].
+  unsigned long last_byte_ms_;
+
+  // Complete command waiting to be collected ahead of building_.
+  Command ready_;
+  bool has_ready_;
+
+  // Binary frame being received or collected, with its length, the number of
+  // body bytes received so far, and its running and transmitted CRC.
+  uint8_t frame_[MAX_FRAME_LENGTH];
+  uint8_t frame_length_;
+  uint8_t frame_received_;
+  uint16_t frame_crc_;
+  uint8_t frame_crc_low_;
+
+  // Offset of the next command to collect from a verified frame, and the
+  // offset at which its commands end.
+  uint8_t frame_cursor_;
+  uint8_t frame_end_;
+
+  // Number of frames discarded.
+  uint16_t frame_errors_;
+};
+
+#endif
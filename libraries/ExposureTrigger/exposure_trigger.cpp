@@ -0,0 +1,83 @@
+#include "exposure_trigger.h"
+#include <Arduino.h>
+
+ExposureTrigger::ExposureTrigger(const int output_pin, const int gate_pin) :
+    output_pin_(output_pin), gate_pin_(gate_pin), is_initialized_(false),
+    mode_(Mode::OFF), settle_ms_(0u), pulse_ms_(1u), gate_enabled_(false),
+    active_(false) {}
+
+void ExposureTrigger::init() {
+  pinMode(output_pin_, OUTPUT);
+  digitalWrite(output_pin_, LOW);
+  pinMode(gate_pin_, INPUT_PULLUP);
+  is_initialized_ = true;
+}
+
+void ExposureTrigger::setMode(const Mode mode) {
+  mode_ = mode;
+}
+
+ExposureTrigger::Mode ExposureTrigger::getMode() const {
+  return mode_;
+}
+
+void ExposureTrigger::setTiming(const uint16_t settle_ms,
+    const uint16_t pulse_ms) {
+  // The step interrupt reads these; don't let it see half of an update.
+  noInterrupts();
+  settle_ms_ = settle_ms;
+  pulse_ms_ = pulse_ms > 0u ? pulse_ms : 1u;
+  interrupts();
+}
+
+void ExposureTrigger::setGateEnabled(const bool gate_enabled) {
+  gate_enabled_ = gate_enabled;
+}
+
+bool ExposureTrigger::isGateEnabled() const {
+  return gate_enabled_;
+}
+
+void ExposureTrigger::release() {
+  noInterrupts();
+  setOutput(false);
+  interrupts();
+}
+
+uint32_t ExposureTrigger::onArrival(const uint32_t since_arrival_us) {
+  if (since_arrival_us == 0u) {
+    // Anything left over from a sequence cut short ends here.
+    setOutput(false);
+  }
+  if (!is_initialized_ || mode_ == Mode::OFF) {
+    return 0u;
+  }
+
+  const uint32_t settle_us = settle_ms_ * 1000ul;
+  if (since_arrival_us < settle_us) {
+    return settle_us - since_arrival_us;
+  }
+  if (!active_) {
+    setOutput(true);
+    // A held level lasts until the mask next departs.
+    return mode_ == Mode::PULSE ? pulse_ms_ * 1000ul : 0u;
+  }
+  setOutput(false);
+  return 0u;
+}
+
+bool ExposureTrigger::onDeparture() {
+  if (is_initialized_ && gate_enabled_ && digitalRead(gate_pin_) != HIGH) {
+    return false;
+  }
+  setOutput(false);
+  return true;
+}
+
+void ExposureTrigger::setOutput(const bool active) {
+  if (!is_initialized_ || active == active_) {
+    return;
+  }
+  digitalWrite(output_pin_, active ? HIGH : LOW);
+  active_ = active;
+}
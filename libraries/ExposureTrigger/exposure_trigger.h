@@ -0,0 +1,108 @@
+#ifndef EXPOSURE_TRIGGER_H_
+#define EXPOSURE_TRIGGER_H_
+
+#include <Arduino.h>  // For uint16_t, uint32_t
+
+// Drives a digital output that triggers a camera once the mask has arrived at
+// its target and settled, and optionally reads a digital input through which
+// the camera holds back the next move until it is ready. Both are timed from
+// the step interrupt: onArrival() and onDeparture() are meant to be installed
+// as a StepperController's settle and departure callbacks, so the output is
+// driven without waiting on loop() or the host, and release() as its release
+// callback, so the output never stays active while the mask moves.
+//
+// The output is active high. The gate input is pulled up and reads ready when
+// high, so an unconnected gate never blocks.
+class ExposureTrigger {
+ public:
+  // How the output responds to an arrival.
+  enum class Mode : int {
+    OFF = 0,  // Output stays inactive. Default value.
+    PULSE,    // Output is active for the pulse width after settling.
+    LEVEL     // Output is active from settling until the next move
+              // departs.
+  };
+
+  // Constructs an ExposureTrigger, delegating Arduino pins for its functions.
+  // The ExposureTrigger is constructed in an uninitialized state.
+  //
+  // output_pin: The Arduino pin driving the trigger output.
+  // gate_pin: The Arduino pin reading the gate input.
+  ExposureTrigger(int output_pin, int gate_pin);
+
+  // Initializes the pins. This must be called before arrivals are reported.
+  void init();
+
+  // Selects how the output responds to arrivals.
+  //
+  // mode: The response to use from the next arrival.
+  void setMode(Mode mode);
+
+  // Retrieves how the output responds to arrivals.
+  //
+  // Returns: The active mode.
+  Mode getMode() const;
+
+  // Sets the output timing.
+  //
+  // settle_ms: Time from arrival until the output goes active [ms].
+  // pulse_ms: Time the output stays active in PULSE mode [ms]. At least 1 ms
+  //           is used.
+  void setTiming(uint16_t settle_ms, uint16_t pulse_ms);
+
+  // Enables or disables the gate input.
+  //
+  // gate_enabled: True to hold back queued moves until the gate is ready.
+  void setGateEnabled(bool gate_enabled);
+
+  // Retrieves whether the gate input is in use.
+  //
+  // Returns: True if queued moves wait on the gate.
+  bool isGateEnabled() const;
+
+  // Returns the output to its inactive level, ending any pulse or held level.
+  // Call this after halting motion partway through a trigger sequence, and
+  // before motion that doesn't come from the queue, as a StepperController's
+  // release callback.
+  void release();
+
+  // Advances the trigger sequence following an arrival. Should be called from
+  // the step interrupt, as a StepperController's settle callback.
+  //
+  // since_arrival_us: Time since the target was reached [us]. Zero marks a
+  //                   new arrival.
+  // Returns: Time until this should next be called [us], or zero once the
+  //          sequence is complete.
+  uint32_t onArrival(uint32_t since_arrival_us);
+
+  // Decides whether the next queued move may start, releasing a held level
+  // if so. Should be called from the step interrupt, as a StepperController's
+  // departure callback.
+  //
+  // Returns: True if the move may start.
+  bool onDeparture();
+
+ private:
+  // Drives the output pin.
+  //
+  // active: True for the active level.
+  void setOutput(bool active);
+
+  // Arduino pins delegated for trigger functions.
+  const int output_pin_;
+  const int gate_pin_;
+
+  // Whether the pins have been initialized.
+  bool is_initialized_;
+
+  // Configuration, shared with the step interrupt.
+  volatile Mode mode_;
+  volatile uint16_t settle_ms_;
+  volatile uint16_t pulse_ms_;
+  volatile bool gate_enabled_;
+
+  // Whether the output is currently active.
+  volatile bool active_;
+};
+
+#endif
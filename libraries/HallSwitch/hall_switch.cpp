@@ -2,13 +2,27 @@
 #include <Arduino.h>
 
 HallSwitch::HallSwitch(const int power_pin, const int state_pin) :
-    power_pin_(power_pin), state_pin_(state_pin), is_initialized_(false) {}
+    power_pin_(power_pin), state_pin_(state_pin), is_initialized_(false),
+    is_capturing_(false), last_triggered_(false), edges_(), edge_head_(0u),
+    edge_tail_(0u), position_callback_(nullptr) {}
 
 void HallSwitch::init() {
   pinMode(power_pin_, OUTPUT);
   digitalWrite(power_pin_, LOW);
   pinMode(state_pin_, INPUT);
   is_initialized_ = true;
+  last_triggered_ = isTriggered();
+
+#if defined(__AVR__)
+  volatile uint8_t* const control = digitalPinToPCICR(state_pin_);
+  if (control != nullptr) {
+    *digitalPinToPCMSK(state_pin_) |= _BV(digitalPinToPCMSKbit(state_pin_));
+    // Discard any change flagged before now.
+    PCIFR = _BV(digitalPinToPCICRbit(state_pin_));
+    *control |= _BV(digitalPinToPCICRbit(state_pin_));
+    is_capturing_ = true;
+  }
+#endif
 }
 
 bool HallSwitch::isInitialized() const {
@@ -30,3 +44,54 @@ bool HallSwitch::isTriggered() const {
 
   return !digitalRead(state_pin_);
 }
+
+void HallSwitch::setPositionCallback(int32_t (*const cb)()) {
+  noInterrupts();
+  position_callback_ = cb;
+  interrupts();
+}
+
+void HallSwitch::onPinChange() {
+  // Latch the position and time first; they are what the edge is for.
+  const int32_t position_steps =
+      position_callback_ != nullptr ? position_callback_() : 0;
+  const uint32_t time_us = micros();
+  const bool triggered = isTriggered();
+  if (triggered == last_triggered_) {
+    return;
+  }
+  last_triggered_ = triggered;
+  if (static_cast<uint8_t>(edge_tail_ - edge_head_) >= EDGE_BUFFER_LENGTH) {
+    return;
+  }
+
+  // Fill the slot before publishing it by advancing the tail.
+  volatile Edge& edge = edges_[edge_tail_ & (EDGE_BUFFER_LENGTH - 1u)];
+  edge.triggered = triggered;
+  edge.position_steps = position_steps;
+  edge.time_us = time_us;
+  edge_tail_++;
+}
+
+bool HallSwitch::takeEdge(Edge* const edge) {
+  if (!is_capturing_) {
+    noInterrupts();
+    onPinChange();
+    interrupts();
+  }
+  if (edge_head_ == edge_tail_) {
+    return false;
+  }
+
+  const volatile Edge& next = edges_[edge_head_ & (EDGE_BUFFER_LENGTH - 1u)];
+  edge->triggered = next.triggered;
+  edge->position_steps = next.position_steps;
+  edge->time_us = next.time_us;
+  // Release the slot only once we're done reading it.
+  edge_head_++;
+  return true;
+}
+
+void HallSwitch::clearEdges() {
+  edge_head_ = edge_tail_;
+}
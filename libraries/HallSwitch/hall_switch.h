@@ -1,10 +1,27 @@
 #ifndef HALL_SWITCH_H_
 #define HALL_SWITCH_H_
 
+#include <Arduino.h>  // For int32_t, uint8_t, uint32_t
+
 // Represents a binary Hall effect switch that detects the presence of a nearby
 // magnetic field.
+//
+// Changes of state are captured by the pin-change interrupt as they happen,
+// along with the motor position and time, so that their positions don't
+// depend on how often the switch is polled. The captured edges are kept in a
+// small ring buffer until taken with takeEdge().
 class HallSwitch {
  public:
+  // A change in the state of the switch.
+  struct Edge {
+    bool triggered;          // Whether the switch became triggered.
+    int32_t position_steps;  // Motor position at the change [steps].
+    uint32_t time_us;        // Time of the change, as from micros() [us].
+  };
+
+  // Number of edges that can be held until taken. Must be a power of two.
+  static const uint8_t EDGE_BUFFER_LENGTH = 8u;
+
   // Constructs a HallSwitch object, delegating Arduino pins for its functions.
   // The HallSwitch object is constructed in an uninitialized state.
   //
@@ -14,7 +31,9 @@ class HallSwitch {
   HallSwitch(int power_pin, int state_pin);
 
   // Initializes the HallEffect object. This must be called before setting the
-  // power state of the switch or reading the switch's state.
+  // power state of the switch or reading the switch's state. On AVR boards,
+  // this also enables the pin-change interrupt for the state pin; the sketch
+  // must route that interrupt's vector to onPinChange().
   void init();
 
   // Checks whether the Hall effect switch has been initialized.
@@ -33,6 +52,29 @@ class HallSwitch {
   // Returns: True if the switch is triggered by a magnetic field.
   bool isTriggered() const;
 
+  // Establishes a function that reports the motor position to capture with
+  // each edge. It is called from the pin-change interrupt, so it must be
+  // quick and must not re-enable interrupts.
+  //
+  // cb: The function to invoke. Set to nullptr to capture zero positions.
+  //  -> returns: The current motor position [steps].
+  void setPositionCallback(int32_t (*cb)());
+
+  // Captures an edge if the state of the switch has changed since the last
+  // one. Call this from the pin-change interrupt for the state pin. An edge
+  // arriving when the buffer is full is dropped.
+  void onPinChange();
+
+  // Takes the oldest captured edge. Where the pin-change interrupt isn't
+  // available, the switch is polled here instead.
+  //
+  // edge: Filled with the edge taken, if any.
+  // Returns: True if an edge was taken, or false if there were none.
+  bool takeEdge(Edge* edge);
+
+  // Discards all captured edges.
+  void clearEdges();
+
  private:
    // Arduino pins delegated for Hall effects switch functions.
    const int power_pin_;
@@ -40,6 +82,22 @@ class HallSwitch {
 
    // Whether the swiltch has been initialized.
    bool is_initialized_;
+
+   // Whether edges are captured by the pin-change interrupt rather than by
+   // polling.
+   bool is_capturing_;
+
+   // State of the switch as of the last captured edge.
+   volatile bool last_triggered_;
+
+   // Ring buffer of captured edges. The free-running tail is advanced only by
+   // onPinChange() and the head only by takeEdge() and clearEdges().
+   volatile Edge edges_[EDGE_BUFFER_LENGTH];
+   volatile uint8_t edge_head_;
+   volatile uint8_t edge_tail_;
+
+   // Callback to invoke for the motor position at each edge.
+   int32_t (*position_callback_)();
 };
 
 #endif
@@ -1,15 +1,19 @@
 #include "index_task.h"
 #include "hall_switch.h"
 #include "mask_controller.h"
+#include "stepper_controller.h"
 #include <Arduino.h>
 
 IndexTask::IndexTask(MaskController* const mask_controller,
     HallSwitch* const hall_switch) : mask_controller_(mask_controller),
     hall_switch_(hall_switch), init_requested_(false), index_requested_(false),
     state_(State::START), last_index_progress_stamp_ms_(0u),
-    index_event_callback_(nullptr) {
+    last_index_progress_step_count_(0u), timeout_steps_(0u), timeout_ms_(0u),
+    has_index_(false), index_zero_offset_cdeg_(0), forward_edge_cdeg_(0),
+    search_limit_cdeg_(0), index_event_callback_(nullptr),
+    state_change_callback_(nullptr) {
   for (size_t i = 0u; i < NUM_KEY_POSITIONS; ++i) {
-    key_positions_deg_[i] = 0.0f;
+    key_positions_cdeg_[i] = 0;
   }
 }
 
@@ -18,6 +22,7 @@ void IndexTask::init() {
 }
 
 void IndexTask::step() {
+  const State previous_state = state_;
   switch (state_) {
     case State::START:
       // Just wait for an init command...
@@ -25,7 +30,7 @@ void IndexTask::step() {
         init_requested_ = false;
         mask_controller_->stop();
         hall_switch_->setPowerState(false);
-        state_ = State::INIT;
+        state_ = has_index_ ? State::INDEXED : State::INIT;
       }
       break;
     case State::INIT:
@@ -33,34 +38,52 @@ void IndexTask::step() {
       // an index command.
       if (index_requested_) {
         index_requested_ = false;
+        beginSearch();
+      }
+      break;
+    case State::APPROACHING:
+      // Slewing to just short of where the index was last found. The slow
+      // search starts from there.
+      if (mask_controller_->getSnapshot(false).behavior !=
+          StepperController::Behavior::TARGETING) {
         mask_controller_->forward();
-        hall_switch_->setPowerState(true);
-        last_index_progress_stamp_ms_ = millis();
+        markProgress();
         state_ = State::WAITING_FOR_FORWARD_LOW;
+      } else if (timedOut()) {
+        mask_controller_->stop();
+        hall_switch_->setPowerState(false);
+        has_index_ = false;
+        announceIndexNotFound();
+        state_ = State::CANNOT_INDEX;
       }
       break;
     case State::WAITING_FOR_FORWARD_LOW:
       // Wait for a low signal. (This is important if an index is requested when
-      // we are currently near the index position.)
+      // we are currently near the index position.) Edges up to now are stale;
+      // any after the switch reads low are kept for the next state.
+      hall_switch_->clearEdges();
+      checkSearchWindow();
       if (!hall_switch_->isTriggered()) {
-        last_index_progress_stamp_ms_ = millis();
+        markProgress();
         state_ = State::FORWARD_LOW;
       } else if (timedOut()) {
         mask_controller_->stop();
         hall_switch_->setPowerState(false);
+        has_index_ = false;
         announceIndexNotFound();
         state_ = State::CANNOT_INDEX;
       }
       break;
     case State::FORWARD_LOW:
       // Continue forward as we wait for a triggered sensor.
-      if (hall_switch_->isTriggered()) {
-        key_positions_deg_[0] = mask_controller_->getPositionDeg(false);
-        last_index_progress_stamp_ms_ = millis();
+      checkSearchWindow();
+      if (takeEdge(true, &key_positions_cdeg_[0])) {
+        markProgress();
         state_ = State::FORWARD_HIGH;
       } else if (timedOut()) {
         mask_controller_->stop();
         hall_switch_->setPowerState(false);
+        has_index_ = false;
         announceIndexNotFound();
         state_ = State::CANNOT_INDEX;
       }
@@ -68,58 +91,65 @@ void IndexTask::step() {
     case State::FORWARD_HIGH:
       // We currently have a triggered sensor... Continue until it's not
       // triggered anymore.
-      if (!hall_switch_->isTriggered()) {
-        key_positions_deg_[1] = mask_controller_->getPositionDeg(false);
+      if (takeEdge(false, &key_positions_cdeg_[1])) {
         mask_controller_->reverse();
-        last_index_progress_stamp_ms_ = millis();
+        markProgress();
         state_ = State::REVERSE_LOW;
       } else if (timedOut()) {
         mask_controller_->stop();
         hall_switch_->setPowerState(false);
+        has_index_ = false;
         announceIndexNotFound();
         state_ = State::CANNOT_INDEX;
       }
       break;
     case State::REVERSE_LOW:
       // Retread our ground in reverse until sensor is high again...
-      if (hall_switch_->isTriggered()) {
-        key_positions_deg_[2] = mask_controller_->getPositionDeg(false);
-        last_index_progress_stamp_ms_ = millis();
+      if (takeEdge(true, &key_positions_cdeg_[2])) {
+        markProgress();
         state_ = State::REVERSE_HIGH;
       } else if (timedOut()) {
         mask_controller_->stop();
         hall_switch_->setPowerState(false);
+        has_index_ = false;
         announceIndexNotFound();
         state_ = State::CANNOT_INDEX;
       }
       break;
     case State::REVERSE_HIGH:
       // Last step in reverse...
-      if (!hall_switch_->isTriggered()) {
-        key_positions_deg_[3] = mask_controller_->getPositionDeg(false);
+      if (takeEdge(false, &key_positions_cdeg_[3])) {
         mask_controller_->stop();
         hall_switch_->setPowerState(false);
 
-        // Calculate average transition position.
-        float angle_sum_deg = 0.0f;
+        // Calculate average transition position, rounded to the nearest
+        // centidegree.
+        int32_t angle_sum_cdeg = 0;
         for (size_t i = 0u; i < NUM_KEY_POSITIONS; ++i) {
-          angle_sum_deg += key_positions_deg_[i];
+          angle_sum_cdeg += key_positions_cdeg_[i];
         }
-        const float offset_deg = angle_sum_deg / NUM_KEY_POSITIONS;
+        const int32_t count = NUM_KEY_POSITIONS;
+        const int32_t offset_cdeg = angle_sum_cdeg >= 0 ?
+            (angle_sum_cdeg + count / 2) / count :
+            (angle_sum_cdeg - count / 2) / count;
 
         // Apply new index position and communicate it via callback.
-        mask_controller_->offsetZero(offset_deg);
+        mask_controller_->offsetZero(offset_cdeg);
+        has_index_ = true;
+        index_zero_offset_cdeg_ = mask_controller_->getZeroOffsetCdeg();
+        forward_edge_cdeg_ = key_positions_cdeg_[0] - offset_cdeg;
         if (index_event_callback_ != nullptr) {
-          index_event_callback_(IndexEvent::INDEX_FOUND, offset_deg);
+          index_event_callback_(IndexEvent::INDEX_FOUND, offset_cdeg);
         }
 
         // Rotate to new zero to show users where we think it is.
-        mask_controller_->rotateTo(0.0f);
-        last_index_progress_stamp_ms_ = millis();
+        mask_controller_->rotateTo(0);
+        markProgress();
         state_ = State::INDEXED;
       } else if (timedOut()) {
         mask_controller_->stop();
         hall_switch_->setPowerState(false);
+        has_index_ = false;
         announceIndexNotFound();
         state_ = State::CANNOT_INDEX;
       }
@@ -129,20 +159,14 @@ void IndexTask::step() {
       // process.
       if (index_requested_) {
         index_requested_ = false;
-        mask_controller_->forward();
-        hall_switch_->setPowerState(true);
-        last_index_progress_stamp_ms_ = millis();
-        state_ = State::WAITING_FOR_FORWARD_LOW;
+        beginSearch();
       }
       break;
     case State::CANNOT_INDEX:
       // Not a lot we can do in an error state except wait for instructions.
       if (index_requested_) {
         index_requested_ = false;
-        mask_controller_->forward();
-        hall_switch_->setPowerState(true);
-        last_index_progress_stamp_ms_ = millis();
-        state_ = State::WAITING_FOR_FORWARD_LOW;
+        beginSearch();
       }
       break;
     default:
@@ -154,27 +178,138 @@ void IndexTask::step() {
       state_ = State::START;
       break;
   }
+
+  if (state_ != previous_state && state_change_callback_ != nullptr) {
+    state_change_callback_(state_);
+  }
 }
 
 void IndexTask::index() {
   index_requested_ = true;
 }
 
+void IndexTask::abort() {
+  index_requested_ = false;
+  if (state_ == State::START || state_ == State::INIT ||
+      state_ == State::INDEXED || state_ == State::CANNOT_INDEX) {
+    return;
+  }
+  mask_controller_->stop();
+  hall_switch_->setPowerState(false);
+  state_ = has_index_ ? State::INDEXED : State::INIT;
+  if (state_change_callback_ != nullptr) {
+    state_change_callback_(state_);
+  }
+}
+
+bool IndexTask::getIndex(int32_t* const index_cdeg,
+    int32_t* const forward_edge_cdeg) const {
+  if (!has_index_) {
+    return false;
+  }
+  *index_cdeg =
+      index_zero_offset_cdeg_ - mask_controller_->getZeroOffsetCdeg();
+  *forward_edge_cdeg = forward_edge_cdeg_;
+  return true;
+}
+
+void IndexTask::restoreIndex(const int32_t index_cdeg,
+    const int32_t forward_edge_cdeg) {
+  has_index_ = true;
+  index_zero_offset_cdeg_ =
+      index_cdeg + mask_controller_->getZeroOffsetCdeg();
+  forward_edge_cdeg_ = forward_edge_cdeg;
+}
+
 IndexTask::State IndexTask::getState() const {
   return state_;
 }
 
 void IndexTask::setIndexEventCallback(
-    void (*const cb)(IndexEvent event, float index_offset_deg)) {
+    void (*const cb)(IndexEvent event, int32_t index_offset_cdeg)) {
   index_event_callback_ = cb;
 }
 
+void IndexTask::setStateChangeCallback(void (*const cb)(State state)) {
+  state_change_callback_ = cb;
+}
+
+void IndexTask::beginSearch() {
+  hall_switch_->setPowerState(true);
+  markProgress();
+  search_limit_cdeg_ = MaskController::INVALID_CDEG;
+  if (has_index_) {
+    // Where the first edge was, given any change of zero since.
+    const int32_t edge_cdeg = index_zero_offset_cdeg_ -
+        mask_controller_->getZeroOffsetCdeg() + forward_edge_cdeg_;
+    const int32_t approach_cdeg = mask_controller_->rotateTo(
+        edge_cdeg - APPROACH_MARGIN_CDEG, MaskController::Direction::AUTO,
+        false);
+    if (approach_cdeg != MaskController::INVALID_CDEG) {
+      search_limit_cdeg_ = approach_cdeg + SEARCH_WINDOW_CDEG;
+      state_ = State::APPROACHING;
+      return;
+    }
+  }
+  mask_controller_->forward();
+  state_ = State::WAITING_FOR_FORWARD_LOW;
+}
+
+void IndexTask::checkSearchWindow() {
+  if (search_limit_cdeg_ == MaskController::INVALID_CDEG ||
+      mask_controller_->getPositionCdeg(false) <= search_limit_cdeg_) {
+    return;
+  }
+  // The index isn't where it was. Carry on forward as a full search would,
+  // with the full timeout.
+  search_limit_cdeg_ = MaskController::INVALID_CDEG;
+  markProgress();
+}
+
+bool IndexTask::takeEdge(const bool triggered, int32_t* const position_cdeg) {
+  HallSwitch::Edge edge;
+  while (hall_switch_->takeEdge(&edge)) {
+    if (edge.triggered == triggered) {
+      *position_cdeg =
+          mask_controller_->stepsToMaskCentidegrees(edge.position_steps);
+      return true;
+    }
+  }
+  return false;
+}
+
+void IndexTask::markProgress() {
+  last_index_progress_stamp_ms_ = millis();
+  last_index_progress_step_count_ =
+      mask_controller_->getSnapshot(false).step_count;
+
+  // Each phase may need to go all the way round. The slowest we sweep is the
+  // start speed, so that bounds the time it takes too.
+  const int32_t limit_cdeg =
+      MaskController::CENTIDEGREES_PER_ROTATION + TIMEOUT_MARGIN_CDEG;
+  // Gearing that reverses the mask's direction gives negative steps.
+  const int32_t limit_steps =
+      mask_controller_->maskCentidegreesToSteps(limit_cdeg);
+  timeout_steps_ = limit_steps >= 0 ? limit_steps : -limit_steps;
+  // A magnitude already, whichever way the gearing turns.
+  int32_t speed_cdeg_per_s = mask_controller_->getStartSpeed();
+  if (speed_cdeg_per_s < 1) {
+    speed_cdeg_per_s = 1;
+  }
+  timeout_ms_ = static_cast<uint32_t>(limit_cdeg) * 1000u /
+      static_cast<uint32_t>(speed_cdeg_per_s) + TIMEOUT_SLACK_MS;
+}
+
 bool IndexTask::timedOut() const {
-  return (int)(millis() - last_index_progress_stamp_ms_) > INDEX_TIMEOUT_MS;
+  const uint32_t travelled_steps =
+      mask_controller_->getSnapshot(false).step_count -
+      last_index_progress_step_count_;
+  return travelled_steps > timeout_steps_ ||
+      millis() - last_index_progress_stamp_ms_ > timeout_ms_;
 }
 
 void IndexTask::announceIndexNotFound() const {
   if (index_event_callback_ != nullptr) {
-    index_event_callback_(IndexEvent::INDEX_NOT_FOUND, 0.0f);
+    index_event_callback_(IndexEvent::INDEX_NOT_FOUND, 0);
   }
 }
@@ -3,7 +3,7 @@
 
 #include "hall_switch.h"
 #include "mask_controller.h"
-#include <Arduino.h>  // For size_t
+#include <Arduino.h>  // For size_t, int32_t
 
 // Operates a cooperative task whose responsibility is to drive a MaskController
 // and HallSwitch in conjunction to determine a new index position for the mask.
@@ -15,8 +15,15 @@
 // The method used to determine an index is to advance the mask forward,
 // recording angular positions at which the Hall effect switch triggers from
 // low to high and from high to low; then doing the same in reverse; then taking
-// the average of all four positions. Finally, the mask homes to its new zero
-// point to show the operator where the device believes this location to be.
+// the average of all four positions. The positions are those the HallSwitch
+// captured as each transition happened, so they don't depend on how promptly
+// step() is called. Finally, the mask homes to its new zero point to show the
+// operator where the device believes this location to be.
+//
+// Once an index has been found, later searches first slew at the configured
+// speed profile to just short of where the first transition was, then sweep
+// slowly from there. If that transition isn't seen within SEARCH_WINDOW_CDEG,
+// the search carries on as a full one.
 class IndexTask {
  public:
   // List of possible states the IndexTask can be in.
@@ -29,7 +36,8 @@ class IndexTask {
     REVERSE_LOW,              // Backward, waiting for low-to-high transition.
     REVERSE_HIGH,             // Backward, waiting for high-to-low transition.
     INDEXED,                  // Index acquired; waiting for next action.
-    CANNOT_INDEX              // Index can't be found; waiting for next action.
+    CANNOT_INDEX,             // Index can't be found; waiting for next action.
+    APPROACHING               // Slewing to just short of the last index.
   };
 
   // Results of indexing operations.
@@ -39,9 +47,22 @@ class IndexTask {
     INDEX_NOT_FOUND  // We failed to find the index.
   };
 
-  // Amount of time we are willing to wait for a HallSwitch state transition
-  // before declaring that the device is  unable to find an index [ms].
-  static const int INDEX_TIMEOUT_MS = 10000u;
+  // How far beyond one revolution of the mask we are willing to travel in
+  // search of a HallSwitch state transition before declaring that the device
+  // is unable to find an index [cdeg].
+  static const int32_t TIMEOUT_MARGIN_CDEG = 1800;
+
+  // Time allowed beyond that the travel should take at the start speed, in
+  // case the mask stops moving [ms].
+  static const uint32_t TIMEOUT_SLACK_MS = 1000u;
+
+  // How far short of the first transition last seen a search slews to before
+  // sweeping slowly [cdeg].
+  static const int32_t APPROACH_MARGIN_CDEG = 500;
+
+  // How far past the point slewed to the first transition must be seen before
+  // the search is treated as a full one [cdeg].
+  static const int32_t SEARCH_WINDOW_CDEG = 1500;
 
   // Construct a new IndexTask, designating  the MaskController and
   // HallSwitch the task will operate.
@@ -53,17 +74,42 @@ class IndexTask {
   // Initialize the IndexTask. This must be requested before calling index().
   void init();
 
-  // Checks for state transitions and takes actions accordingly. Call this as
-  // frequently as possible to improve indexing resolution.
+  // Checks for state transitions and takes actions accordingly. Call this
+  // frequently; transitions are timed by the HallSwitch, but the reversal
+  // waits for this call.
   void step();
 
   // Seek an index position for the mask. An index position will be established
   // where the task estimates a local peak in magnetic field strength, which
   // will typically be triggered when the magnet is directly above the physical
   // Hall effect sensor. Note that this operation will change the index of the
-  // MaskController, affecting all subsequent MaskController actions.
+  // MaskController, affecting all subsequent MaskController actions. If an
+  // index was found before, the search begins by slewing to near it.
   void index();
 
+  // Abandons a search in progress, or one requested but not yet begun,
+  // halting the mask immediately. Any index found before is kept.
+  void abort();
+
+  // Retrieves where the last index found lies.
+  //
+  // index_cdeg: Set to the angle of the index relative to the current zero
+  //             [cdeg].
+  // forward_edge_cdeg: Set to the angle of the first transition relative to
+  //                    the index [cdeg].
+  // Returns: True if an index has been found, or false if the outputs were
+  //          left unset.
+  bool getIndex(int32_t* index_cdeg, int32_t* forward_edge_cdeg) const;
+
+  // Adopts an index found before, such as one saved across a restart, as if
+  // it had just been found. Nothing is moved. Call this before the first
+  // step() to start out INDEXED.
+  //
+  // index_cdeg: Angle of the index relative to the current zero [cdeg].
+  // forward_edge_cdeg: Angle of the first transition relative to the index
+  //                    [cdeg].
+  void restoreIndex(int32_t index_cdeg, int32_t forward_edge_cdeg);
+
   // Retrieves the current state of the IndexTask. See the State enumeration.
   //
   // Returns: The current State enumerator describing the state of the task.
@@ -73,16 +119,44 @@ class IndexTask {
   //
   // cb: The function to invoke when we have finished looking for an index.
   //  -> event: The outcome of the indexing operation.
-  //  -> index_offset_deg: The angle the index position has been adjusted by as
-  //                       a result of the indexing operation [deg]. Set to
-  //                       nullptr to remove the callback.
-  void setIndexEventCallback(void (*cb)(IndexEvent event, float index_offset_deg));
+  //  -> index_offset_cdeg: The angle the index position has been adjusted by
+  //                        as a result of the indexing operation [cdeg]. Set
+  //                        to nullptr to remove the callback.
+  void setIndexEventCallback(
+      void (*cb)(IndexEvent event, int32_t index_offset_cdeg));
+
+  // Establishes a function to call whenever the task changes state.
+  //
+  // cb: The function to invoke when the state changes. Set to nullptr to
+  //     remove the callback.
+  //  -> state: The state the task has just entered.
+  void setStateChangeCallback(void (*cb)(State state));
 
  private:
   // Length of array in which we store positions to use in calculating an
   // index position.
   static const size_t NUM_KEY_POSITIONS = 4u;
 
+  // Powers the HallSwitch and begins searching, slewing to near the last
+  // index first if there was one.
+  void beginSearch();
+
+  // Ends a search that began near the last index if it has gone too far
+  // without finding the first transition, so that the full timeout applies.
+  void checkSearchWindow();
+
+  // Takes edges captured by the HallSwitch until one in the given direction
+  // is found, discarding any others.
+  //
+  // triggered: Whether to look for the switch becoming triggered.
+  // position_cdeg: Set to the mask angle at the edge [cdeg], if one is found.
+  // Returns: True if such an edge was found.
+  bool takeEdge(bool triggered, int32_t* position_cdeg);
+
+  // Notes that a phase of the search has begun, and sets how far and how long
+  // it may go on for from the gearing and start speed.
+  void markProgress();
+
   // Utility method to check when an index timeout has occurred.
   //
   // Returns: True if a timeout is active.
@@ -108,12 +182,34 @@ class IndexTask {
   // reference for index timeouts.
   unsigned long last_index_progress_stamp_ms_;
 
+  // Motor step count at the same moment. Used as a reference for index
+  // timeouts by distance.
+  uint32_t last_index_progress_step_count_;
+
+  // Steps travelled and time elapsed after which the current phase times
+  // out [steps], [ms].
+  uint32_t timeout_steps_;
+  uint32_t timeout_ms_;
+
   // Container for angle datapoints used in the determination of the True
   // index position.
-  float key_positions_deg_[NUM_KEY_POSITIONS];
+  int32_t key_positions_cdeg_[NUM_KEY_POSITIONS];
+
+  // Whether an index has been found, the MaskController's zero offset once it
+  // was applied [cdeg], and the angle of the first transition from it [cdeg].
+  bool has_index_;
+  int32_t index_zero_offset_cdeg_;
+  int32_t forward_edge_cdeg_;
+
+  // Angle past which a search that began near the last index no longer
+  // expects the first transition [cdeg], or INVALID_CDEG for a full search.
+  int32_t search_limit_cdeg_;
 
   // Callback to invoke when we have finished looking for an index.
-  void (*index_event_callback_)(IndexEvent event, float index_offset_deg);
+  void (*index_event_callback_)(IndexEvent event, int32_t index_offset_cdeg);
+
+  // Callback to invoke when the task changes state.
+  void (*state_change_callback_)(State state);
 };
 
 #endif
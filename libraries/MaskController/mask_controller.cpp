@@ -1,16 +1,20 @@
 #include "mask_controller.h"
 #include "stepper_controller.h"
-#include <Math.h>
 
 MaskController::MaskController(
     volatile StepperController* const stepper_controller,
-    const float gear_ratio) : stepper_controller_(stepper_controller),
-    gear_ratio_(gear_ratio), target_deg_(0.0f) {}
+    const int16_t mask_teeth, const int16_t motor_teeth) :
+    stepper_controller_(stepper_controller), mask_teeth_(mask_teeth),
+    motor_teeth_(motor_teeth), gearing_steps_per_rotation_(0),
+    steps_per_cycle_(0), cdeg_per_cycle_(0), gearing_fits_32_(true),
+    target_cdeg_(0),
+    motor_target_cdeg_(0),
+    queue_end_cdeg_(0), backlash_cdeg_(0) {}
 
 void MaskController::forward() {
   if (stepper_controller_ == nullptr) {
     return;
-  } else if (gear_ratio_ > 0.0f) {
+  } else if (mask_teeth_ > 0) {
     stepper_controller_->forward();
   } else {
     stepper_controller_->reverse();
@@ -20,7 +24,7 @@ void MaskController::forward() {
 void MaskController::reverse() {
   if (stepper_controller_ == nullptr) {
     return;
-  } else if (gear_ratio_ > 0.0f) {
+  } else if (mask_teeth_ > 0) {
     stepper_controller_->reverse();
   } else {
     stepper_controller_->forward();
@@ -32,86 +36,499 @@ void MaskController::stop() {
     return;
   } else {
     stepper_controller_->stop();
+    queue_end_cdeg_ = getPositionCdeg(false);
   }
 }
 
-float MaskController::rotateTo(const float target_deg,
+// Motor rate [steps/s] = mask rate [udeg/s] * mask teeth * steps per rotation
+// / (motor teeth * udeg per rotation), worked in 64 bits. The velocity scale
+// and udeg per rotation share a factor of 256, which is cancelled to keep the
+// products small.
+int32_t MaskController::setVelocity(const int32_t udeg_per_s) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  const int64_t factor = static_cast<int64_t>(mask_teeth_) *
+      stepper_controller_->getStepsPerRotation() *
+      (StepperController::VELOCITY_SCALE / 256);
+  const int64_t divisor = static_cast<int64_t>(motor_teeth_) *
+      (MICRODEGREES_PER_ROTATION / 256);
+  if (factor == 0 || divisor <= 0) {
+    return INVALID_CDEG;
+  }
+  const int64_t limit = 0x7FFFFFFFLL;
+  const int64_t magnitude = udeg_per_s >= 0 ? udeg_per_s :
+      -static_cast<int64_t>(udeg_per_s);
+  int64_t motor_q20 = 0;
+  if (magnitude > 0x7FFFFFFFFFFFFFFFLL / (factor >= 0 ? factor : -factor)) {
+    // Far beyond the fastest representable rate anyway.
+    motor_q20 = (udeg_per_s >= 0) == (factor >= 0) ? limit : -limit;
+  } else {
+    motor_q20 = roundedDivide(udeg_per_s * factor, divisor);
+    motor_q20 = motor_q20 > limit ? limit :
+        motor_q20 < -limit ? -limit : motor_q20;
+  }
+  stepper_controller_->setVelocity(static_cast<int32_t>(motor_q20));
+
+  // Convert back so the caller knows what it got.
+  if ((motor_q20 >= 0 ? motor_q20 : -motor_q20) >
+      0x7FFFFFFFFFFFFFFFLL / divisor) {
+    return (motor_q20 >= 0) == (factor >= 0) ? limit : -limit;
+  }
+  const int64_t applied = roundedDivide(motor_q20 * divisor, factor);
+  return static_cast<int32_t>(applied > limit ? limit :
+      applied < -limit ? -limit : applied);
+}
+
+int32_t MaskController::rotateTo(const int32_t target_cdeg,
     const Direction direction, const bool wrap_result) {
   if (stepper_controller_ == nullptr) {
-    return NAN;
+    return INVALID_CDEG;
+  }
+  return rotateTo(target_cdeg, stepper_controller_->getProfile(), direction,
+      wrap_result);
+}
+
+int32_t MaskController::rotateTo(const int32_t target_cdeg,
+    const StepperController::Profile profile, const Direction direction,
+    const bool wrap_result) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+
+  if (direction == Direction::NONE) {
+    stop();
+  }
+  // Resolve from wherever the mask is now, even mid-move. The target is
+  // absolute, so the motor moving on meanwhile doesn't shift it.
+  const int32_t current_cdeg = getPositionCdeg(false);
+  const int32_t resolved_cdeg = direction == Direction::AUTO ?
+      fastestTargetCdeg(current_cdeg, target_cdeg, profile) :
+      resolveTargetCdeg(current_cdeg, target_cdeg, direction);
+  return moveToCdeg(resolved_cdeg, profile, wrap_result);
+}
+
+int32_t MaskController::rotateBy(const int32_t angle_cdeg,
+    const bool wrap_result) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  return rotateBy(angle_cdeg, stepper_controller_->getProfile(), wrap_result);
+}
+
+int32_t MaskController::rotateBy(const int32_t angle_cdeg,
+    const StepperController::Profile profile, const bool wrap_result) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  // At rest on a target we commanded, count from the exact angle asked for
+  // rather than the step it was rounded to, so that repeated relative moves
+  // don't accumulate the rounding.
+  const Snapshot snapshot = getSnapshot(false);
+  const int32_t from_cdeg =
+      snapshot.behavior == StepperController::Behavior::REACHED_TARGET ?
+      snapshot.target_cdeg : snapshot.position_cdeg;
+  return moveToCdeg(from_cdeg + angle_cdeg, profile, wrap_result);
+}
+
+int32_t MaskController::enqueueMoveTo(const int32_t target_cdeg,
+    const Direction direction, const StepperController::Profile profile,
+    const uint16_t dwell_ms, const bool wrap_result) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
   }
+  updateQueueEnd();
+  return enqueueMoveBy(
+      resolveTargetCdeg(queue_end_cdeg_, target_cdeg, direction) -
+          queue_end_cdeg_, profile, dwell_ms, wrap_result);
+}
+
+int32_t MaskController::enqueueMoveBy(const int32_t angle_cdeg,
+    const StepperController::Profile profile, const uint16_t dwell_ms,
+    const bool wrap_result) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  updateQueueEnd();
+  // Queue absolute motor angles so that roundoff doesn't accumulate over a
+  // long sequence of moves.
+  const int32_t end_cdeg = queue_end_cdeg_ + angle_cdeg;
+  if (!stepper_controller_->enqueueMoveSteps(maskCentidegreesToSteps(end_cdeg),
+      profile, dwell_ms)) {
+    return INVALID_CDEG;
+  }
+  queue_end_cdeg_ = end_cdeg;
+  return wrap_result ? wrapAngleCdeg(end_cdeg) : end_cdeg;
+}
+
+void MaskController::updateQueueEnd() {
+  // Continuous motion flushes the queue and ends wherever the motor stops,
+  // which isn't known when it is commanded.
+  const StepperController::Snapshot motor_snapshot =
+      stepper_controller_->getSnapshot();
+  if (motor_snapshot.behavior == StepperController::Behavior::STOPPED &&
+      stepper_controller_->getQueuedMoveCount() == 0u) {
+    queue_end_cdeg_ = stepsToMaskCentidegrees(motor_snapshot.position_steps);
+  }
+}
+
+uint32_t MaskController::estimateMoveUs(const int32_t from_cdeg,
+    const int32_t target_cdeg, const Direction direction,
+    const StepperController::Profile profile, const bool reversing) const {
+  if (stepper_controller_ == nullptr) {
+    return 0u;
+  }
+  const int32_t to_cdeg = resolveTargetCdeg(from_cdeg, target_cdeg, direction);
+  const int32_t displacement_steps = maskCentidegreesToSteps(to_cdeg) -
+      maskCentidegreesToSteps(from_cdeg);
+  uint32_t distance_steps = displacement_steps >= 0 ? displacement_steps :
+      -displacement_steps;
+  if (reversing) {
+    distance_steps += backlashSteps();
+  }
+  return stepper_controller_->estimateRestMoveUs(distance_steps, profile);
+}
+
+uint8_t MaskController::getQueuedMoveCount() const {
+  if (stepper_controller_ == nullptr) {
+    return 0u;
+  }
+  return stepper_controller_->getQueuedMoveCount();
+}
+
+uint8_t MaskController::flushQueue() {
+  if (stepper_controller_ == nullptr) {
+    return 0u;
+  }
+  const uint8_t discarded = stepper_controller_->flushQueue();
+  // With nothing discarded, queue_end_cdeg_ may already reflect a stop.
+  if (discarded > 0u) {
+    queue_end_cdeg_ = getTargetCdeg(false);
+  }
+  return discarded;
+}
+
+bool MaskController::isIdle() const {
+  if (stepper_controller_ == nullptr) {
+    return true;
+  }
+  return stepper_controller_->isIdle();
+}
+
+MaskController::Snapshot MaskController::getSnapshot(const bool wrap_result)
+    const {
+  Snapshot snapshot = {INVALID_CDEG, INVALID_CDEG,
+      StepperController::Behavior::STOPPED, 0u};
+  if (stepper_controller_ == nullptr) {
+    return snapshot;
+  }
+  const StepperController::Snapshot motor_snapshot =
+      stepper_controller_->getSnapshot();
+  snapshot.position_cdeg =
+      stepsToMaskCentidegrees(motor_snapshot.position_steps);
+  snapshot.target_cdeg = maskTargetCdeg(motor_snapshot);
+  if (wrap_result) {
+    snapshot.position_cdeg = wrapAngleCdeg(snapshot.position_cdeg);
+    snapshot.target_cdeg = wrapAngleCdeg(snapshot.target_cdeg);
+  }
+  snapshot.behavior = motor_snapshot.behavior;
+  snapshot.step_count = motor_snapshot.step_count;
+  return snapshot;
+}
+
+int32_t MaskController::getPositionCdeg(const bool wrap_result) const {
+  return getSnapshot(wrap_result).position_cdeg;
+}
+
+int32_t MaskController::getTargetCdeg(const bool wrap_result) const {
+  return getSnapshot(wrap_result).target_cdeg;
+}
+
+void MaskController::setZero() {
+  if (stepper_controller_ == nullptr) {
+    return;
+  }
+  stepper_controller_->stop();
+  stepper_controller_->setZero();
+  queue_end_cdeg_ = 0;
+}
 
-  // Stop and record because the motor angle would theoretically change as we
-  // progress through the function if we didn't do this.
+void MaskController::offsetZero(const int32_t relative_angle_cdeg) {
+  if (stepper_controller_ == nullptr) {
+    return;
+  }
   stepper_controller_->stop();
-  const float current_deg = getPositionDeg(false);
-  const float forward_delta_deg = wrapAngleDeg(target_deg - current_deg);
-  const float reverse_delta_deg = wrapAngleDeg(current_deg - target_deg);
+  stepper_controller_->offsetZeroSteps(
+      maskCentidegreesToSteps(relative_angle_cdeg));
+  queue_end_cdeg_ = getPositionCdeg(false);
+}
+
+int32_t MaskController::getZeroOffsetCdeg() const {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  // Converted from the motor's offset so that it carries no more than one
+  // rounding however many times the zero has moved.
+  return stepsToMaskCentidegrees(stepper_controller_->getZeroOffsetSteps());
+}
+
+int32_t MaskController::setStartSpeed(const int32_t cdeg_per_s) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  stepper_controller_->setStartSpeed(maskRateToMotorSteps(cdeg_per_s));
+  return motorStepsToMaskRate(stepper_controller_->getStartSpeed());
+}
+
+int32_t MaskController::getStartSpeed() const {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  return motorStepsToMaskRate(stepper_controller_->getStartSpeed());
+}
+
+int32_t MaskController::setCruiseSpeed(const int32_t cdeg_per_s) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  stepper_controller_->setCruiseSpeed(maskRateToMotorSteps(cdeg_per_s));
+  return motorStepsToMaskRate(stepper_controller_->getCruiseSpeed());
+}
+
+int32_t MaskController::getCruiseSpeed() const {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  return motorStepsToMaskRate(stepper_controller_->getCruiseSpeed());
+}
+
+int32_t MaskController::setAcceleration(const int32_t cdeg_per_s2) {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  stepper_controller_->setAcceleration(maskRateToMotorSteps(cdeg_per_s2));
+  return motorStepsToMaskRate(stepper_controller_->getAcceleration());
+}
 
-  float delta_to_use_deg = 0.0f;
+void MaskController::setProfile(const StepperController::Profile profile) {
+  if (stepper_controller_ == nullptr) {
+    return;
+  }
+  stepper_controller_->setProfile(profile);
+}
+
+void MaskController::setBacklash(const int32_t backlash_cdeg) {
+  backlash_cdeg_ = backlash_cdeg > 0 ? backlash_cdeg : 0;
+}
+
+int32_t MaskController::getBacklash() const {
+  return backlash_cdeg_;
+}
+
+int16_t MaskController::getMaskTeeth() const {
+  return mask_teeth_;
+}
+
+int16_t MaskController::getMotorTeeth() const {
+  return motor_teeth_;
+}
+
+int32_t MaskController::getStepAngleCdeg() const {
+  if (stepper_controller_ == nullptr) {
+    return INVALID_CDEG;
+  }
+  const int32_t step_cdeg = motorStepsToMaskRate(1u);
+  return step_cdeg > 0 ? step_cdeg : 1;
+}
+
+uint32_t MaskController::maskRateToMotorSteps(const int32_t mask_rate_cdeg)
+    const {
+  const int32_t motor_rate_steps = maskCentidegreesToSteps(mask_rate_cdeg);
+  return motor_rate_steps >= 0 ? motor_rate_steps : -motor_rate_steps;
+}
+
+int32_t MaskController::motorStepsToMaskRate(const uint32_t motor_rate_steps)
+    const {
+  const int32_t mask_rate_cdeg = stepsToMaskCentidegrees(motor_rate_steps);
+  return mask_rate_cdeg >= 0 ? mask_rate_cdeg : -mask_rate_cdeg;
+}
+
+int32_t MaskController::maskTargetCdeg(
+    const StepperController::Snapshot& motor_snapshot) const {
+  // Once the motion queue has moved the motor on from the last target we
+  // commanded ourselves, the motor's own target is the best we know.
+  return motor_snapshot.target_cdeg == motor_target_cdeg_ ? target_cdeg_ :
+      stepsToMaskCentidegrees(motor_snapshot.target_steps);
+}
+
+int32_t MaskController::resolveTargetCdeg(const int32_t from_cdeg,
+    const int32_t target_cdeg, const Direction direction) {
+  const int32_t forward_delta_cdeg = wrapAngleCdeg(target_cdeg - from_cdeg);
+  const int32_t reverse_delta_cdeg = wrapAngleCdeg(from_cdeg - target_cdeg);
+
+  int32_t delta_to_use_cdeg = 0;
   switch (direction) {
     default:
     case Direction::NONE:
       break;
     case Direction::FORWARD:
-      delta_to_use_deg = forward_delta_deg;
+      delta_to_use_cdeg = forward_delta_cdeg;
       break;
     case Direction::REVERSE:
-      delta_to_use_deg = -reverse_delta_deg;
+      delta_to_use_cdeg = -reverse_delta_cdeg;
       break;
     case Direction::AUTO:
-      delta_to_use_deg = forward_delta_deg < reverse_delta_deg ?
-          forward_delta_deg : -reverse_delta_deg;
+      delta_to_use_cdeg = forward_delta_cdeg < reverse_delta_cdeg ?
+          forward_delta_cdeg : -reverse_delta_cdeg;
       break;
   }
+  return from_cdeg + delta_to_use_cdeg;
+}
 
-  return rotateBy(delta_to_use_deg, wrap_result);
+int32_t MaskController::fastestTargetCdeg(const int32_t from_cdeg,
+    const int32_t target_cdeg, const StepperController::Profile profile)
+    const {
+  const int32_t forward_cdeg =
+      resolveTargetCdeg(from_cdeg, target_cdeg, Direction::FORWARD);
+  const int32_t reverse_cdeg =
+      resolveTargetCdeg(from_cdeg, target_cdeg, Direction::REVERSE);
+  if (forward_cdeg == reverse_cdeg) {
+    return forward_cdeg;
+  }
+
+  const int32_t position_steps =
+      stepper_controller_->getSnapshot().position_steps;
+  const uint32_t backlash_steps = backlashSteps();
+  const uint32_t forward_us = stepper_controller_->estimateMoveUs(
+      maskCentidegreesToSteps(forward_cdeg) - position_steps,
+      profile, backlash_steps);
+  const uint32_t reverse_us = stepper_controller_->estimateMoveUs(
+      maskCentidegreesToSteps(reverse_cdeg) - position_steps,
+      profile, backlash_steps);
+  // Ties go in reverse, as they did when only the angles were compared.
+  return forward_us < reverse_us ? forward_cdeg : reverse_cdeg;
 }
 
-float MaskController::rotateBy(const float angle_deg, const bool wrap_result) {
-  target_deg_ = getPositionDeg(false) + angle_deg;
-  // We use rotateTo() below rather than rotateBy() so that we don't accumulate
-  // roundoff error  between target_deg_ and the converted motor angle target in
-  // repeated calls to this function.
-  const float nominal_deg = motorToMaskAngleDeg(
-      stepper_controller_->rotateTo(maskToMotorAngleDeg(target_deg_)));
-  return wrap_result ? wrapAngleDeg(nominal_deg) : nominal_deg;
+int32_t MaskController::moveToCdeg(const int32_t target_cdeg,
+    const StepperController::Profile profile, const bool wrap_result) {
+  target_cdeg_ = target_cdeg;
+  queue_end_cdeg_ = target_cdeg_;
+  // Command an absolute step position converted straight from the mask angle,
+  // so that the same angle always lands on the same step.
+  const int32_t motor_target_steps = stepper_controller_->rotateToSteps(
+      maskCentidegreesToSteps(target_cdeg_), profile);
+  motor_target_cdeg_ =
+      stepper_controller_->stepsToCentidegrees(motor_target_steps);
+  const int32_t nominal_cdeg = stepsToMaskCentidegrees(motor_target_steps);
+  return wrap_result ? wrapAngleCdeg(nominal_cdeg) : nominal_cdeg;
 }
 
-float MaskController::getPositionDeg(const bool wrap_result) const {
-  const float nominal_deg =
-      motorToMaskAngleDeg(stepper_controller_->getPositionDeg());
-  return wrap_result ? wrapAngleDeg(nominal_deg) : nominal_deg;
+uint32_t MaskController::backlashSteps() const {
+  const int32_t backlash_steps = maskCentidegreesToSteps(backlash_cdeg_);
+  return backlash_steps >= 0 ? backlash_steps : -backlash_steps;
 }
 
-float MaskController::getTargetDeg(const bool wrap_result) const {
-  return wrap_result ? wrapAngleDeg(target_deg_) : target_deg_;
+int32_t MaskController::wrapAngleCdeg(const int32_t nominal_cdeg) {
+  const int32_t wrapped_cdeg = nominal_cdeg % CENTIDEGREES_PER_ROTATION;
+  return wrapped_cdeg >= 0 ? wrapped_cdeg :
+      wrapped_cdeg + CENTIDEGREES_PER_ROTATION;
 }
 
-void MaskController::setZero() {
+// Steps = mask angle * mask teeth * steps per rotation /
+// (motor teeth * cdeg per rotation), worked with the ratio in lowest terms.
+// Whole cycles of the gear train are a whole number of steps, so only the
+// remainder needs rounding, and that fits in 32 bits for any practical
+// gearing. This runs for every snapshot, so 64-bit division is kept for
+// gearing that doesn't fit.
+int32_t MaskController::maskCentidegreesToSteps(const int32_t mask_angle_cdeg)
+    const {
   if (stepper_controller_ == nullptr) {
-    return;
+    return 0;
   }
-  stepper_controller_->stop();
-  stepper_controller_->setZero();
+  updateGearing();
+  if (cdeg_per_cycle_ == 0) {
+    return 0;
+  }
+  if (!gearing_fits_32_) {
+    return static_cast<int32_t>(roundedDivide(
+        static_cast<int64_t>(mask_angle_cdeg) * steps_per_cycle_,
+        static_cast<int64_t>(cdeg_per_cycle_)));
+  }
+  const int32_t cycles = mask_angle_cdeg / cdeg_per_cycle_;
+  const int32_t remainder_cdeg = mask_angle_cdeg % cdeg_per_cycle_;
+  return cycles * steps_per_cycle_ +
+      roundedDivide(remainder_cdeg * steps_per_cycle_, cdeg_per_cycle_);
 }
 
-void MaskController::offsetZero(const float relative_angle_deg) {
+int32_t MaskController::stepsToMaskCentidegrees(const int32_t steps) const {
   if (stepper_controller_ == nullptr) {
-    return;
+    return 0;
   }
-  stepper_controller_->stop();
-  stepper_controller_->offsetZero(maskToMotorAngleDeg(relative_angle_deg));
+  updateGearing();
+  if (steps_per_cycle_ == 0) {
+    return 0;
+  }
+  if (!gearing_fits_32_) {
+    return static_cast<int32_t>(roundedDivide(
+        static_cast<int64_t>(steps) * cdeg_per_cycle_,
+        static_cast<int64_t>(steps_per_cycle_)));
+  }
+  // As above. The remainder takes the sign of the steps, so divide by the
+  // magnitude of the cycle.
+  const int32_t cycles = steps / steps_per_cycle_;
+  const int32_t remainder_steps = steps % steps_per_cycle_;
+  const int32_t remainder_cdeg = steps_per_cycle_ > 0 ?
+      roundedDivide(remainder_steps * cdeg_per_cycle_, steps_per_cycle_) :
+      roundedDivide(-remainder_steps * cdeg_per_cycle_, -steps_per_cycle_);
+  return cycles * cdeg_per_cycle_ + remainder_cdeg;
 }
 
-float MaskController::wrapAngleDeg(const float nominal) {
-  return nominal - 360.0f * floor(nominal / 360.0f);
+void MaskController::updateGearing() const {
+  const int16_t steps_per_rotation =
+      stepper_controller_->getStepsPerRotation();
+  if (steps_per_rotation == gearing_steps_per_rotation_) {
+    return;
+  }
+  gearing_steps_per_rotation_ = steps_per_rotation;
+
+  // Both products fit in 32 bits for any 16-bit tooth counts and steps per
+  // rotation. Euclid's algorithm finds their common factor.
+  int32_t steps = static_cast<int32_t>(mask_teeth_) * steps_per_rotation;
+  int32_t cdeg = static_cast<int32_t>(motor_teeth_) * CENTIDEGREES_PER_ROTATION;
+  int32_t divisor = steps >= 0 ? steps : -steps;
+  int32_t remainder = cdeg;
+  while (remainder != 0) {
+    const int32_t next = divisor % remainder;
+    divisor = remainder;
+    remainder = next;
+  }
+  if (divisor > 0) {
+    steps /= divisor;
+    cdeg /= divisor;
+  }
+  steps_per_cycle_ = steps;
+  cdeg_per_cycle_ = cdeg;
+
+  // Remainders are smaller than a cycle, so their products are bounded by the
+  // product of the two terms plus half the larger for rounding.
+  const int32_t magnitude = steps >= 0 ? steps : -steps;
+  const int32_t larger = magnitude > cdeg ? magnitude : cdeg;
+  gearing_fits_32_ = magnitude == 0 ||
+      cdeg <= (0x7FFFFFFFL - larger) / magnitude;
 }
 
-float MaskController::maskToMotorAngleDeg(const float mask_angle_deg) const {
-  return mask_angle_deg * gear_ratio_;
+int32_t MaskController::roundedDivide(const int32_t numerator,
+    const int32_t denominator) {
+  // Rounds half away from zero, like round().
+  return numerator >= 0 ? (numerator + denominator / 2) / denominator :
+      -((-numerator + denominator / 2) / denominator);
 }
 
-float MaskController::motorToMaskAngleDeg(const float motor_angle_deg) const {
-  return motor_angle_deg / gear_ratio_;
+int64_t MaskController::roundedDivide(const int64_t numerator,
+    const int64_t denominator) {
+  // Round half away from zero; either sign may be negative.
+  const uint64_t magnitude = numerator >= 0 ? numerator : -numerator;
+  const uint64_t divisor = denominator >= 0 ? denominator : -denominator;
+  const int64_t quotient = (magnitude + divisor / 2u) / divisor;
+  return (numerator >= 0) == (denominator >= 0) ? quotient : -quotient;
 }
@@ -6,6 +6,11 @@
 // Operates a StepperController to manipulate a mask interfacing with a stepper
 // motor. Maintains knowledge of the gear ratio between motor and mask in order
 // to drive the motor to the desired angles.
+//
+// The ratio is held as an exact fraction in lowest terms, and mask angles are
+// converted straight to and from motor steps with a single rounding. Every
+// unwrapped mask angle therefore maps to one step position however it is
+// reached, and no error accumulates over a session.
 class MaskController {
   public:
     // Preferences for direction of motion.
@@ -16,13 +21,30 @@ class MaskController {
       AUTO       // Direction that will reach the target the fastest.
     };
 
+    // Angle of one full rotation [cdeg].
+    static const int32_t CENTIDEGREES_PER_ROTATION = 36000;
+
+    // Returned in place of an angle when no StepperController is attached.
+    static const int32_t INVALID_CDEG = -2147483647L - 1;
+
+    // A coherent copy of the mask state.
+    struct Snapshot {
+      int32_t position_cdeg;                 // Position of the mask [cdeg].
+      int32_t target_cdeg;                   // Target of the mask [cdeg].
+      StepperController::Behavior behavior;  // Active motor behavior.
+      uint32_t step_count;                   // Motor steps taken; wraps.
+    };
+
     // Constructs a MaskController that operates a specified StepperController
-    // using a given gear ratio between motor and mask.
+    // using a given gear ratio between motor and mask. The motor turns
+    // mask_teeth / motor_teeth rotations per rotation of the mask.
     //
     // stepper_controller: The StepperController to drive.
-    // gear_ratio: Rotations of motor per one rotation of mask.
+    // mask_teeth: Teeth on the mask gear. Negative if the mask turns against
+    //             the motor.
+    // motor_teeth: Teeth on the motor gear. Must be positive.
     MaskController(volatile StepperController* stepper_controller,
-        float gear_ratio);
+        int16_t mask_teeth, int16_t motor_teeth);
 
     // Drives the mask forward continuously.
     void forward();
@@ -33,76 +55,367 @@ class MaskController {
     // Halts mask motion.
     void stop();
 
-    // Rotates the mask to an absolute angle.
+    // Runs the mask continuously at a signed angular rate, changing smoothly
+    // from any rate already set. Suited to slow tracking: the long-run rate is
+    // exact to within the conversion to motor steps. See
+    // StepperController::setVelocity().
+    //
+    // udeg_per_s: Signed angular rate of the mask [udeg/s].
+    // Returns: The rate actually applied [udeg/s], or INVALID_CDEG if no
+    //          StepperController is attached.
+    int32_t setVelocity(int32_t udeg_per_s);
+
+    // Rotates the mask to an absolute angle. A move made while the mask is
+    // already approaching a target blends into it where it can; see
+    // StepperController::rotateTo(). With Direction::AUTO, the direction is
+    // the one predicted to arrive sooner given the present motion, the speed
+    // profile and the backlash. Direction::NONE halts the mask.
     //
-    // target_deg: Absolute angle to rotate the mask to [deg].
+    // target_cdeg: Absolute angle to rotate the mask to [cdeg].
     // direction: Preferred direction of motion.
     // wrap_result: Whether the angle returned from the function is wrapped to
     //              the range [0, 360) degrees.
-    // Returns: The actual absolute angle rotated to [deg]. May not match the
+    // Returns: The actual absolute angle rotated to [cdeg]. May not match the
     //          specified angle exactly due to motor resolution limits.
-    float rotateTo(float target_deg, Direction direction = Direction::AUTO,
-        bool wrap_result = true);
+    int32_t rotateTo(int32_t target_cdeg,
+        Direction direction = Direction::AUTO, bool wrap_result = true);
 
-    // Rotates the mask by a relative angle.
+    // Rotates the mask by a relative angle. When the mask is at rest on a
+    // target, the angle is counted from that target as commanded rather than
+    // as rounded to a motor step.
     //
-    // angle_deg: Relative angle to rotate the mask by [deg].
+    // angle_cdeg: Relative angle to rotate the mask by [cdeg].
     // direction: Preferred direction of motion.
     // wrap_result: Whether the angle returned from the function is wrapped to
     //              the range [0, 360) degrees.
-    // Returns: The actual absolute angle rotated to [deg]. May not match the
+    // Returns: The actual absolute angle rotated to [cdeg]. May not match the
     //          specified angle exactly due to motor resolution limits.
-    float rotateBy(float angle_deg, bool wrap_result = true);
+    int32_t rotateBy(int32_t angle_cdeg, bool wrap_result = true);
+
+    // Rotates the mask to an absolute angle using a specific speed profile for
+    // this move only. Otherwise as above.
+    //
+    // target_cdeg: Absolute angle to rotate the mask to [cdeg].
+    // profile: The speed profile to follow during the move.
+    // direction: Preferred direction of motion.
+    // wrap_result: Whether the angle returned from the function is wrapped to
+    //              the range [0, 360) degrees.
+    // Returns: The actual absolute angle rotated to [cdeg].
+    int32_t rotateTo(int32_t target_cdeg, StepperController::Profile profile,
+        Direction direction = Direction::AUTO, bool wrap_result = true);
+
+    // Rotates the mask by a relative angle using a specific speed profile for
+    // this move only.
+    //
+    // angle_cdeg: Relative angle to rotate the mask by [cdeg].
+    // profile: The speed profile to follow during the move.
+    // wrap_result: Whether the angle returned from the function is wrapped to
+    //              the range [0, 360) degrees.
+    // Returns: The actual absolute angle rotated to [cdeg].
+    int32_t rotateBy(int32_t angle_cdeg, StepperController::Profile profile,
+        bool wrap_result = true);
+
+    // Appends a move to an absolute angle to the motor's motion queue. The
+    // direction is resolved relative to where the previously queued move (or
+    // the move in progress) ends.
+    //
+    // target_cdeg: Absolute angle to rotate the mask to [cdeg].
+    // direction: Preferred direction of motion.
+    // profile: The speed profile to follow during the move.
+    // dwell_ms: Time to hold at the target before the next queued move [ms].
+    // wrap_result: Whether the angle returned from the function is wrapped to
+    //              the range [0, 360) degrees.
+    // Returns: The absolute angle the move will end at [cdeg], or INVALID_CDEG
+    //          if the queue is full or the mask is moving continuously.
+    int32_t enqueueMoveTo(int32_t target_cdeg, Direction direction,
+        StepperController::Profile profile, uint16_t dwell_ms,
+        bool wrap_result = true);
+
+    // Appends a move by a relative angle to the motor's motion queue. The angle
+    // is relative to where the previously queued move (or the move in
+    // progress) ends.
+    //
+    // angle_cdeg: Relative angle to rotate the mask by [cdeg].
+    // profile: The speed profile to follow during the move.
+    // dwell_ms: Time to hold at the target before the next queued move [ms].
+    // wrap_result: Whether the angle returned from the function is wrapped to
+    //              the range [0, 360) degrees.
+    // Returns: The absolute angle the move will end at [cdeg], or INVALID_CDEG
+    //          if the queue is full or the mask is moving continuously.
+    int32_t enqueueMoveBy(int32_t angle_cdeg,
+        StepperController::Profile profile, uint16_t dwell_ms,
+        bool wrap_result = true);
+
+    // Predicts how long a move between two angles would take, from rest to
+    // rest, after quantizing both to motor steps. See
+    // StepperController::estimateRestMoveUs().
+    //
+    // from_cdeg: The unwrapped angle the move starts from [cdeg].
+    // target_cdeg: The absolute angle to rotate to [cdeg].
+    // direction: Direction of motion; AUTO takes the shorter way.
+    // profile: The speed profile the move would follow.
+    // reversing: Whether the move sets off against the previous one, taking
+    //            up the backlash.
+    // Returns: Predicted duration of the move [us], or zero if no
+    //          StepperController is attached.
+    uint32_t estimateMoveUs(int32_t from_cdeg, int32_t target_cdeg,
+        Direction direction, StepperController::Profile profile,
+        bool reversing) const;
+
+    // Retrieves the number of moves waiting in the motion queue.
+    //
+    // Returns: Number of queued moves, not counting the move in progress.
+    uint8_t getQueuedMoveCount() const;
+
+    // Discards all queued moves, letting the move in progress finish.
+    //
+    // Returns: Number of moves discarded.
+    uint8_t flushQueue();
+
+    // Checks whether the mask has come to rest with nothing left to do: no
+    // move in progress, no dwell being held and nothing queued.
+    //
+    // Returns: True if the motor is idle or no StepperController is attached.
+    bool isIdle() const;
+
+    // Captures the position, target and behavior of the mask as of a single
+    // instant, without disabling the step interrupt.
+    //
+    // wrap_result: Whether the angles returned are wrapped to the range
+    //              [0, 360) degrees.
+    // Returns: The mask state. Angles are INVALID_CDEG if no StepperController
+    //          is attached.
+    Snapshot getSnapshot(bool wrap_result = true) const;
 
     // Retrieves the current absolute position of the mask.
     //
     // wrap_result: Whether the angle returned from the function is wrapped to
     //              the range [0, 360) degrees.
-    // Returns: The current absolute position of the mask [deg].
-    float getPositionDeg(bool wrap_result = true) const;
+    // Returns: The current absolute position of the mask [cdeg].
+    int32_t getPositionCdeg(bool wrap_result = true) const;
 
     // Retrieves the current target position of the mask.
     //
     // wrap_result: Whether the angle returned from the function is wrapped to
     //              the range [0, 360) degrees.
-    // Returns: The current target position of the mask [deg].
-    float getTargetDeg(bool wrap_result = true) const;
+    // Returns: The current target position of the mask [cdeg].
+    int32_t getTargetCdeg(bool wrap_result = true) const;
 
     // Establishes the current mask position to be an absolute angle of zero.
     void setZero();
 
     // Offsets the existing zero reference by an angle.
     //
-    // relative_angle_deg: The angle to offset the zero reference by [deg].
-    void offsetZero(float relative_angle_deg);
+    // relative_angle_cdeg: The angle to offset the zero reference by [cdeg].
+    void offsetZero(int32_t relative_angle_cdeg);
+
+    // Retrieves how far the zero reference has been moved in total since
+    // construction. A mask angle plus this offset is the same physical angle
+    // whatever zero is in use.
+    //
+    // Returns: Total offset of the zero reference [cdeg], or INVALID_CDEG if
+    //          no StepperController is attached.
+    int32_t getZeroOffsetCdeg() const;
+
+    // Sets the mask speed at which moves begin and end, and at which
+    // continuous forward() and reverse() motion runs.
+    //
+    // cdeg_per_s: Start speed of the mask [cdeg/s].
+    // Returns: The start speed actually applied [cdeg/s]. May not match the
+    //          specified speed exactly due to motor resolution limits.
+    int32_t setStartSpeed(int32_t cdeg_per_s);
+
+    // Retrieves the mask speed at which moves begin and end, and at which
+    // continuous forward() and reverse() motion runs.
+    //
+    // Returns: Start speed of the mask [cdeg/s], or INVALID_CDEG if no
+    //          StepperController is attached.
+    int32_t getStartSpeed() const;
+
+    // Sets the mask speed reached during the middle of ramped moves.
+    //
+    // cdeg_per_s: Cruise speed of the mask [cdeg/s].
+    // Returns: The cruise speed actually applied [cdeg/s].
+    int32_t setCruiseSpeed(int32_t cdeg_per_s);
+
+    // Retrieves the mask speed reached during the middle of ramped moves.
+    //
+    // Returns: Cruise speed of the mask [cdeg/s], or INVALID_CDEG if no
+    //          StepperController is attached.
+    int32_t getCruiseSpeed() const;
+
+    // Sets the mask acceleration used to ramp between start and cruise speeds.
+    //
+    // cdeg_per_s2: Acceleration of the mask [cdeg/s^2].
+    // Returns: The acceleration actually applied [cdeg/s^2].
+    int32_t setAcceleration(int32_t cdeg_per_s2);
+
+    // Selects the speed profile used by subsequent calls to rotateTo() and
+    // rotateBy() that don't specify one.
+    //
+    // profile: The speed profile to use.
+    void setProfile(StepperController::Profile profile);
+
+    // Sets the lost motion in the drive train that is taken up whenever the
+    // mask reverses direction. It is only used to predict which direction
+    // reaches a target sooner.
+    //
+    // backlash_cdeg: Backlash, as an angle of the mask [cdeg]. Negative
+    //                values are treated as zero.
+    void setBacklash(int32_t backlash_cdeg);
 
-    // Converts a mask angle to a motor angle.
+    // Retrieves the lost motion taken up on reversing direction.
     //
-    // mask_angle_deg: An absolute mask angle [deg].
-    // Returns: The motor angle corresponding to the mask angle [deg].
-    float maskToMotorAngleDeg(float mask_angle_deg) const;
+    // Returns: Backlash, as an angle of the mask [cdeg].
+    int32_t getBacklash() const;
 
-    // Converts a motor angle to a mask angle.
+    // Retrieves the number of teeth on the mask's gear.
     //
-    // motor_angle_deg: An absolute motor angle [deg].
-    // Returns: The mask angle corresponding to the motor angle [deg].
-    float motorToMaskAngleDeg(float motor_angle_deg) const;
+    // Returns: Mask gear teeth.
+    int16_t getMaskTeeth() const;
+
+    // Retrieves the number of teeth on the motor's gear.
+    //
+    // Returns: Motor gear teeth.
+    int16_t getMotorTeeth() const;
+
+    // Retrieves the angle the mask turns for one motor step in the active
+    // step mode.
+    //
+    // Returns: The mask angle of one step, rounded but at least 1 [cdeg], or
+    //          INVALID_CDEG if no StepperController is attached.
+    int32_t getStepAngleCdeg() const;
+
+    // Converts a mask angle to a motor position.
+    //
+    // mask_angle_cdeg: An absolute mask angle [cdeg].
+    // Returns: The motor position nearest the mask angle [steps].
+    int32_t maskCentidegreesToSteps(int32_t mask_angle_cdeg) const;
+
+    // Converts a motor position to a mask angle.
+    //
+    // steps: An absolute motor position [steps].
+    // Returns: The mask angle at the motor position, rounded [cdeg].
+    int32_t stepsToMaskCentidegrees(int32_t steps) const;
 
   private:
+    // Converts a mask rate (speed or acceleration) to a motor step rate.
+    //
+    // mask_rate_cdeg: The mask rate [cdeg/s or cdeg/s^2].
+    // Returns: The magnitude of the corresponding motor rate [steps/s or
+    //          steps/s^2].
+    uint32_t maskRateToMotorSteps(int32_t mask_rate_cdeg) const;
+
+    // Converts a motor step rate (speed or acceleration) to a mask rate.
+    //
+    // motor_rate_steps: The motor rate [steps/s or steps/s^2].
+    // Returns: The magnitude of the corresponding mask rate [cdeg/s or
+    //          cdeg/s^2].
+    int32_t motorStepsToMaskRate(uint32_t motor_rate_steps) const;
+
+    // Angle of one full rotation [udeg].
+    static const int32_t MICRODEGREES_PER_ROTATION = 360000000L;
+
+    // Converts the target in a motor snapshot to a mask angle.
+    //
+    // motor_snapshot: The motor state to convert.
+    // Returns: The unwrapped target of the mask [cdeg].
+    int32_t maskTargetCdeg(const StepperController::Snapshot& motor_snapshot)
+        const;
+
+    // Chooses the unwrapped absolute angle at which a move to a given angle
+    // should end.
+    //
+    // from_cdeg: The unwrapped angle the move starts from [cdeg].
+    // target_cdeg: The absolute angle to rotate to [cdeg].
+    // direction: Preferred direction of motion.
+    // Returns: The unwrapped angle to end at [cdeg].
+    static int32_t resolveTargetCdeg(int32_t from_cdeg, int32_t target_cdeg,
+        Direction direction);
+
+    // Chooses between the forward and reverse angles at which a move to a
+    // given angle could end by predicting which the motor reaches sooner.
+    //
+    // from_cdeg: The unwrapped angle the move starts from [cdeg].
+    // target_cdeg: The absolute angle to rotate to [cdeg].
+    // profile: The speed profile the move will follow.
+    // Returns: The unwrapped angle to end at [cdeg].
+    int32_t fastestTargetCdeg(int32_t from_cdeg, int32_t target_cdeg,
+        StepperController::Profile profile) const;
+
+    // Commands the motor toward an unwrapped mask angle.
+    //
+    // target_cdeg: The unwrapped angle to rotate to [cdeg].
+    // profile: The speed profile to follow during the move.
+    // wrap_result: Whether the angle returned from the function is wrapped to
+    //              the range [0, 360) degrees.
+    // Returns: The actual absolute angle rotated to [cdeg].
+    int32_t moveToCdeg(int32_t target_cdeg, StepperController::Profile profile,
+        bool wrap_result);
+
+    // Converts the backlash to motor steps.
+    //
+    // Returns: The magnitude of the backlash [steps].
+    uint32_t backlashSteps() const;
+
+    // Catches queue_end_cdeg_ up with where continuous motion stopped, once
+    // the motor is at rest with nothing queued.
+    void updateQueueEnd();
+
+    // Reduces the gear ratio to lowest terms for the active step mode, if it
+    // hasn't been already.
+    void updateGearing() const;
+
     // Wraps an unbounded angle to the range [0, 360) degrees.
     //
-    // nominal_deg: The unbounded angle [deg].
-    // Returns: An equivalent angle on the range [0, 360) degrees.
-    static float wrapAngleDeg(float nominal_deg);
+    // nominal_cdeg: The unbounded angle [cdeg].
+    // Returns: An equivalent angle on the range [0, 36000) centidegrees.
+    static int32_t wrapAngleCdeg(int32_t nominal_cdeg);
+
+    // Divides two integers, rounding the quotient to the nearest integer.
+    //
+    // numerator: The dividend.
+    // denominator: The divisor. Must be positive.
+    // Returns: The quotient, with halves rounded away from zero.
+    static int32_t roundedDivide(int32_t numerator, int32_t denominator);
+
+    // Divides two integers in 64 bits, rounding the quotient to the nearest
+    // integer. Slow on AVR; kept for velocities and outsized gearing.
+    //
+    // numerator: The dividend.
+    // denominator: The divisor. Must not be zero.
+    // Returns: The quotient, with halves rounded away from zero.
+    static int64_t roundedDivide(int64_t numerator, int64_t denominator);
 
     // The StepperController this MaskController manipulates.
     volatile StepperController* const stepper_controller_;
 
-    // Rotations of motor per one rotation of mask.
-    const float gear_ratio_;
+    // Teeth on the mask and motor gears.
+    const int16_t mask_teeth_;
+    const int16_t motor_teeth_;
+
+    // The gear ratio in lowest terms: steps_per_cycle_ motor steps turn the
+    // mask through cdeg_per_cycle_, both gears then being back where they
+    // started. Worked out for gearing_steps_per_rotation_ motor steps per
+    // rotation, and again whenever the step mode changes that.
+    mutable int16_t gearing_steps_per_rotation_;
+    mutable int32_t steps_per_cycle_;
+    mutable int32_t cdeg_per_cycle_;
+
+    // Whether conversions within one cycle fit in 32 bits.
+    mutable bool gearing_fits_32_;
+
+    // Absolute target angle of the last move commanded directly [cdeg], and
+    // the motor angle it was reported as [cdeg].
+    int32_t target_cdeg_;
+    int32_t motor_target_cdeg_;
+
+    // Unwrapped angle at which the last queued move, or else the move in
+    // progress, will end [cdeg].
+    int32_t queue_end_cdeg_;
 
-    // Current absolute target angle [deg].
-    float target_deg_;
+    // Lost motion taken up on reversing direction [cdeg].
+    int32_t backlash_cdeg_;
 };
 
 #endif
@@ -0,0 +1,83 @@
+#include "output_buffer.h"
+
+OutputBuffer::OutputBuffer() : buffer_(), head_(0u), committed_(0u),
+    tail_(0u), in_message_(false), message_overflowed_(false),
+    message_bytes_(0u), dropped_messages_(0u), dropped_bytes_(0u) {}
+
+size_t OutputBuffer::write(const uint8_t c) {
+  if (in_message_) {
+    addSaturating(&message_bytes_, 1u);
+  }
+  if (in_message_ && message_overflowed_) {
+    return 0u;
+  }
+  if (availableForWrite() <= 0) {
+    if (in_message_) {
+      message_overflowed_ = true;
+    } else {
+      addSaturating(&dropped_bytes_, 1u);
+    }
+    return 0u;
+  }
+
+  buffer_[tail_ & (CAPACITY - 1u)] = c;
+  tail_++;
+  if (!in_message_) {
+    committed_ = tail_;
+  }
+  return 1u;
+}
+
+int OutputBuffer::availableForWrite() {
+  return CAPACITY - static_cast<uint8_t>(tail_ - head_);
+}
+
+bool OutputBuffer::isEmpty() const {
+  return head_ == tail_;
+}
+
+void OutputBuffer::beginMessage() {
+  in_message_ = true;
+  message_overflowed_ = false;
+  message_bytes_ = 0u;
+}
+
+bool OutputBuffer::endMessage() {
+  in_message_ = false;
+  if (message_overflowed_) {
+    // Roll back whatever part of the message did fit.
+    addSaturating(&dropped_messages_, 1u);
+    addSaturating(&dropped_bytes_, message_bytes_);
+    tail_ = committed_;
+    return false;
+  }
+  committed_ = tail_;
+  return true;
+}
+
+void OutputBuffer::drain(HardwareSerial& serial) {
+  int room = serial.availableForWrite();
+  while (room > 0 && head_ != committed_) {
+    serial.write(buffer_[head_ & (CAPACITY - 1u)]);
+    head_++;
+    room--;
+  }
+}
+
+uint16_t OutputBuffer::getDroppedMessageCount() const {
+  return dropped_messages_;
+}
+
+uint16_t OutputBuffer::getDroppedByteCount() const {
+  return dropped_bytes_;
+}
+
+void OutputBuffer::resetDroppedCounts() {
+  dropped_messages_ = 0u;
+  dropped_bytes_ = 0u;
+}
+
+void OutputBuffer::addSaturating(uint16_t* const counter,
+    const uint16_t amount) {
+  *counter = *counter > 0xFFFFu - amount ? 0xFFFFu : *counter + amount;
+}
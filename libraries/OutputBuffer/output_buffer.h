@@ -0,0 +1,97 @@
+#ifndef OUTPUT_BUFFER_H_
+#define OUTPUT_BUFFER_H_
+
+#include <Arduino.h>  // For Print, HardwareSerial, uint8_t
+
+// Holds outgoing serial text in a ring buffer so that formatting a response
+// never waits on the UART. The buffer is drained into the hardware transmit
+// buffer only as fast as it has room. Text written between beginMessage() and
+// endMessage() is sent whole or not at all: if it doesn't fit, it is dropped
+// and counted rather than sent truncated.
+class OutputBuffer : public Print {
+ public:
+  // Number of bytes the buffer can hold. Must be a power of two no greater
+  // than 128.
+  static const uint8_t CAPACITY = 128u;
+
+  // Constructs an empty OutputBuffer.
+  OutputBuffer();
+
+  // Appends a byte. Outside of a message, the byte is dropped and counted if
+  // the buffer is full.
+  //
+  // c: The byte to append.
+  // Returns: 1 if the byte was stored, or 0 if it was dropped.
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+  // Reports how many more bytes can be appended.
+  //
+  // Returns: Free space in the buffer [bytes].
+  int availableForWrite() override;
+
+  // Checks whether any bytes are waiting to be drained, including those of a
+  // message in progress.
+  //
+  // Returns: True if the buffer holds nothing.
+  bool isEmpty() const;
+
+  // Starts a message. Bytes written from now until endMessage() are held back
+  // from drain() and are discarded together if any of them doesn't fit.
+  void beginMessage();
+
+  // Finishes a message, releasing it to drain() if it fit entirely.
+  //
+  // Returns: True if the message was kept, or false if it was dropped.
+  bool endMessage();
+
+  // Moves as many buffered bytes as the serial port can accept without
+  // blocking into its transmit buffer.
+  //
+  // serial: The port to send through.
+  void drain(HardwareSerial& serial);
+
+  // Retrieves the number of messages dropped for lack of space.
+  //
+  // Returns: Dropped message count. Saturates rather than wrapping.
+  uint16_t getDroppedMessageCount() const;
+
+  // Retrieves the number of bytes dropped for lack of space, counting both
+  // bytes of dropped messages and individually dropped bytes.
+  //
+  // Returns: Dropped byte count. Saturates rather than wrapping.
+  uint16_t getDroppedByteCount() const;
+
+  // Zeroes the dropped message and byte counts.
+  void resetDroppedCounts();
+
+ private:
+  // Adds to a saturating counter.
+  //
+  // counter: The counter to add to.
+  // amount: The amount to add.
+  static void addSaturating(uint16_t* counter, uint16_t amount);
+
+  // Storage for buffered bytes.
+  uint8_t buffer_[CAPACITY];
+
+  // Free-running indices of the oldest unsent byte, the end of the bytes
+  // released to drain(), and the end of all stored bytes. Masked by
+  // CAPACITY - 1 to address buffer_.
+  uint8_t head_;
+  uint8_t committed_;
+  uint8_t tail_;
+
+  // Whether a message is in progress, and whether it has failed to fit.
+  bool in_message_;
+  bool message_overflowed_;
+
+  // Number of bytes written to the message in progress, stored or not.
+  uint16_t message_bytes_;
+
+  // Overflow statistics. See the corresponding getters.
+  uint16_t dropped_messages_;
+  uint16_t dropped_bytes_;
+};
+
+#endif
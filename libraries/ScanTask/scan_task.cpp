@@ -0,0 +1,137 @@
+#include "scan_task.h"
+#include "mask_controller.h"
+#include "stepper_controller.h"
+#include <Arduino.h>
+
+ScanTask::ScanTask(MaskController* const mask_controller)
+    : mask_controller_(mask_controller), scan_(), state_(State::IDLE),
+    points_queued_(0u), points_reached_(0u), scan_event_callback_(nullptr) {}
+
+bool ScanTask::start(const Scan& scan) {
+  if (isActive() || scan.point_count == 0u) {
+    return false;
+  }
+  const StepperController::Behavior behavior =
+      mask_controller_->getSnapshot(false).behavior;
+  if (behavior == StepperController::Behavior::FORWARD ||
+      behavior == StepperController::Behavior::REVERSE) {
+    // Queued moves would wait forever behind continuous motion.
+    mask_controller_->stop();
+  } else {
+    mask_controller_->flushQueue();
+  }
+  scan_ = scan;
+  points_queued_ = 0u;
+  points_reached_ = 0u;
+  state_ = State::RUNNING;
+  step();
+  return true;
+}
+
+void ScanTask::pause() {
+  if (state_ != State::RUNNING) {
+    return;
+  }
+  // Withdrawn points will be queued again on resuming.
+  points_queued_ -= mask_controller_->flushQueue();
+  state_ = State::PAUSED;
+  announce(ScanEvent::PAUSED, points_reached_);
+}
+
+void ScanTask::resume() {
+  if (state_ != State::PAUSED) {
+    return;
+  }
+  state_ = State::RUNNING;
+  announce(ScanEvent::RESUMED, points_reached_);
+  step();
+}
+
+void ScanTask::abort() {
+  if (!isActive()) {
+    return;
+  }
+  mask_controller_->stop();
+  state_ = State::ABORTED;
+  announce(ScanEvent::ABORTED, points_reached_);
+}
+
+void ScanTask::step() {
+  if (!isActive()) {
+    return;
+  }
+
+  // Read the queue before the behavior: if a move starts in between, we
+  // undercount for now rather than overcount.
+  const uint8_t waiting = mask_controller_->getQueuedMoveCount();
+  const StepperController::Behavior behavior =
+      mask_controller_->getSnapshot(false).behavior;
+  const bool moving = behavior == StepperController::Behavior::TARGETING;
+
+  // Once our first point has started, the mask only ever targets or holds at
+  // targets until the queue runs dry. Anything else means the mask was
+  // commandeered, and whatever we had queued is gone.
+  if (points_queued_ > 0u && waiting == 0u && !moving &&
+      behavior != StepperController::Behavior::REACHED_TARGET) {
+    state_ = State::ABORTED;
+    announce(ScanEvent::ABORTED, points_reached_);
+    return;
+  }
+
+  const uint32_t points_reached = points_queued_ - waiting - (moving ? 1u : 0u);
+  while (points_reached_ < points_reached) {
+    announce(ScanEvent::POINT_REACHED, points_reached_);
+    points_reached_++;
+  }
+
+  if (state_ != State::RUNNING) {
+    return;
+  }
+  while (!allQueued()) {
+    const uint16_t point = points_queued_ % scan_.point_count;
+    const int32_t target_cdeg = scan_.start_cdeg +
+        static_cast<int32_t>(point) * scan_.increment_cdeg;
+    if (mask_controller_->enqueueMoveTo(target_cdeg, scan_.direction,
+        scan_.profile, scan_.dwell_ms, false) == MaskController::INVALID_CDEG) {
+      // Queue is full; we'll top it up next time.
+      break;
+    }
+    points_queued_++;
+  }
+
+  // The mask only goes idle once the final dwell has elapsed.
+  if (allQueued() && points_reached_ == points_queued_ &&
+      mask_controller_->isIdle()) {
+    state_ = State::FINISHED;
+    announce(ScanEvent::FINISHED, points_reached_);
+  }
+}
+
+ScanTask::State ScanTask::getState() const {
+  return state_;
+}
+
+void ScanTask::setScanEventCallback(
+    void (*const cb)(ScanEvent event, uint16_t point, uint16_t pass)) {
+  scan_event_callback_ = cb;
+}
+
+bool ScanTask::isActive() const {
+  return state_ == State::RUNNING || state_ == State::PAUSED;
+}
+
+bool ScanTask::allQueued() const {
+  if (scan_.pass_count == 0u) {
+    return false;
+  }
+  return points_queued_ >=
+      static_cast<uint32_t>(scan_.point_count) * scan_.pass_count;
+}
+
+void ScanTask::announce(const ScanEvent event, const uint32_t point_number)
+    const {
+  if (scan_event_callback_ != nullptr) {
+    scan_event_callback_(event, point_number % scan_.point_count,
+        point_number / scan_.point_count);
+  }
+}
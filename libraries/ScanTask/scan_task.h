@@ -0,0 +1,124 @@
+#ifndef SCAN_TASK_H_
+#define SCAN_TASK_H_
+
+#include "mask_controller.h"
+#include "stepper_controller.h"
+#include <Arduino.h>  // For int32_t, uint16_t, uint32_t
+
+// Operates a cooperative task that steps a MaskController through a series of
+// evenly spaced angles, holding at each for a fixed dwell time, for one or more
+// passes. The task keeps the motion queue topped up so that every move and
+// dwell is timed by the step interrupt rather than by the caller. No other
+// functions should attempt to manipulate the MaskController or its
+// dependencies while a scan is running or paused; call abort() first.
+class ScanTask {
+ public:
+  // List of possible states the ScanTask can be in.
+  enum class State : int {
+    IDLE = 0,  // No scan has been started. Default value.
+    RUNNING,   // Moving through the scan.
+    PAUSED,    // Finishing the point in progress, then holding.
+    FINISHED,  // Every point of every pass has been visited.
+    ABORTED    // The scan was abandoned before finishing.
+  };
+
+  // Progress notifications.
+  enum class ScanEvent : int {
+    NONE = 0,       // Default value.
+    POINT_REACHED,  // The mask arrived at a point and has begun its dwell.
+    PAUSED,         // The scan was paused.
+    RESUMED,        // The scan was resumed.
+    FINISHED,       // The final dwell of the final pass has elapsed.
+    ABORTED         // The scan was abandoned.
+  };
+
+  // Description of a scan.
+  struct Scan {
+    int32_t start_cdeg;                   // Angle of the first point [cdeg].
+    int32_t increment_cdeg;               // Spacing between points [cdeg].
+    uint16_t point_count;                 // Points per pass.
+    uint16_t dwell_ms;                    // Hold time at each point [ms].
+    uint16_t pass_count;                  // Passes; zero means endless.
+    MaskController::Direction direction;  // Direction to each point.
+    StepperController::Profile profile;   // Speed profile of each move.
+  };
+
+  // Constructs a new ScanTask, designating the MaskController it will operate.
+  //
+  // mask_controller: The MaskController to operate.
+  explicit ScanTask(MaskController* mask_controller);
+
+  // Begins a new scan, discarding any queued moves and halting continuous
+  // motion. Has no effect while a scan is running or paused.
+  //
+  // scan: The scan to perform.
+  // Returns: True if the scan was started.
+  bool start(const Scan& scan);
+
+  // Stops feeding the scan to the mask. Queued points are withdrawn; the point
+  // in progress, including its dwell, is allowed to finish.
+  void pause();
+
+  // Continues a paused scan from the first point not yet visited.
+  void resume();
+
+  // Abandons a running or paused scan, halting the mask immediately.
+  void abort();
+
+  // Tracks the mask's progress through the scan and queues further points.
+  // Call this regularly; the queue holds enough points that timing is not
+  // critical.
+  void step();
+
+  // Retrieves the current state of the ScanTask. See the State enumeration.
+  //
+  // Returns: The current State enumerator describing the state of the task.
+  State getState() const;
+
+  // Establishes a function to call as the scan progresses.
+  //
+  // cb: The function to invoke on progress. Set to nullptr to remove the
+  //     callback.
+  //  -> event: What has happened.
+  //  -> point: For POINT_REACHED, the index of the point reached within its
+  //            pass; otherwise that of the next point to be reached.
+  //  -> pass: The index of the pass that point belongs to.
+  void setScanEventCallback(
+      void (*cb)(ScanEvent event, uint16_t point, uint16_t pass));
+
+ private:
+  // Checks whether a scan is being carried out, paused or not.
+  //
+  // Returns: True if the task is running or paused.
+  bool isActive() const;
+
+  // Checks whether every point of the scan has been queued.
+  //
+  // Returns: True if no points remain to be queued.
+  bool allQueued() const;
+
+  // Utility method announcing an event via callback.
+  //
+  // event: The event to announce.
+  // point_number: Number of the point concerned since the scan started.
+  void announce(ScanEvent event, uint32_t point_number) const;
+
+  // The MaskController to manipulate.
+  MaskController* const mask_controller_;
+
+  // The scan being performed.
+  Scan scan_;
+
+  // Current state of the ScanTask.
+  State state_;
+
+  // Number of points handed to the motion queue and not withdrawn, and number
+  // of those the mask has arrived at.
+  uint32_t points_queued_;
+  uint32_t points_reached_;
+
+  // Callback to invoke as the scan progresses.
+  void (*scan_event_callback_)(ScanEvent event, uint16_t point, uint16_t pass);
+};
+
+#endif
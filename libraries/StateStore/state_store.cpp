@@ -0,0 +1,214 @@
+#include "state_store.h"
+#include "bipolar_stepper.h"
+#include "index_task.h"
+#include "mask_controller.h"
+#include <Arduino.h>
+#include <EEPROM.h>
+
+StateStore::StateStore(MaskController* const mask_controller,
+    IndexTask* const index_task, BipolarStepper* const stepper) :
+    mask_controller_(mask_controller), index_task_(index_task),
+    stepper_(stepper), is_restored_(false), stored_(), stored_slot_(0u),
+    stored_sequence_(0u), has_stored_(false), stored_current_(false),
+    last_motion_ms_(0u), image_(), pending_(), pending_slot_(0u),
+    bytes_written_(SLOT_SIZE) {}
+
+StateStore::Restored StateStore::restore() {
+  is_restored_ = true;
+  last_motion_ms_ = millis();
+
+  // The newest intact record is the one with the latest sequence number.
+  uint8_t flag = POSITION_STALE;
+  for (uint8_t slot = 0u; slot < NUM_SLOTS; ++slot) {
+    const uint16_t address = slotAddress(slot);
+    for (uint8_t i = 0u; i < SLOT_SIZE; ++i) {
+      image_[i] = EEPROM.read(address + i);
+    }
+    if (image_[CHECKSUM_OFFSET] != checksum()) {
+      continue;
+    }
+    if (has_stored_ &&
+        static_cast<int8_t>(image_[0] - stored_sequence_) <= 0) {
+      continue;
+    }
+    decode(&stored_);
+    stored_slot_ = slot;
+    stored_sequence_ = image_[0];
+    has_stored_ = true;
+    flag = image_[FLAG_OFFSET];
+  }
+  if (!has_stored_ ||
+      stored_.mask_teeth != mask_controller_->getMaskTeeth() ||
+      stored_.motor_teeth != mask_controller_->getMotorTeeth()) {
+    // The angles would mean something else now.
+    return Restored::NOTHING;
+  }
+
+  mask_controller_->setBacklash(stored_.backlash_cdeg);
+  // Without its phase, the rotor would snap to the nearest position of
+  // another one, up to two full steps away, when first energized.
+  if (flag != POSITION_CURRENT || !stepper_->setPhase(stored_.motor_phase)) {
+    return Restored::CALIBRATION;
+  }
+  mask_controller_->offsetZero(-stored_.position_cdeg);
+  if (stored_.has_index) {
+    index_task_->restoreIndex(stored_.index_cdeg, stored_.forward_edge_cdeg);
+  }
+  stored_current_ = true;
+  return Restored::POSITION;
+}
+
+void StateStore::step() {
+  if (!is_restored_) {
+    return;
+  }
+
+  const unsigned long now_ms = millis();
+  if (!mask_controller_->isIdle()) {
+    last_motion_ms_ = now_ms;
+    // Abandon any record in progress; it will fail its checksum.
+    bytes_written_ = SLOT_SIZE;
+    if (has_stored_ && stored_current_ &&
+        writeByte(slotAddress(stored_slot_) + FLAG_OFFSET, POSITION_STALE)) {
+      stored_current_ = false;
+    }
+    return;
+  }
+
+  if (bytes_written_ < SLOT_SIZE) {
+    // The sequence number goes last. Until then the slot keeps the older
+    // number it held, so a record cut short can't outrank the one before it
+    // even if it passes its checksum by chance.
+    const uint8_t offset =
+        bytes_written_ + 1u < SLOT_SIZE ? bytes_written_ + 1u : 0u;
+    if (!writeByte(slotAddress(pending_slot_) + offset, image_[offset])) {
+      return;
+    }
+    bytes_written_++;
+    if (bytes_written_ == SLOT_SIZE) {
+      stored_ = pending_;
+      stored_slot_ = pending_slot_;
+      stored_sequence_ = image_[0];
+      has_stored_ = true;
+      stored_current_ = true;
+    }
+    return;
+  }
+
+  if (now_ms - last_motion_ms_ < REST_MS) {
+    return;
+  }
+  const Record record = capture();
+  if (has_stored_ && isSame(record, stored_)) {
+    // Back where the newest record says; just mark it current again.
+    if (!stored_current_ &&
+        writeByte(slotAddress(stored_slot_) + FLAG_OFFSET, POSITION_CURRENT)) {
+      stored_current_ = true;
+    }
+    return;
+  }
+
+  // Start a new record in the next slot, leaving the newest in force until
+  // the new one is complete.
+  pending_ = record;
+  pending_slot_ = has_stored_ ? (stored_slot_ + 1u) % NUM_SLOTS : 0u;
+  encode(has_stored_ ? stored_sequence_ + 1u : 0u, pending_);
+  image_[FLAG_OFFSET] = POSITION_CURRENT;
+  bytes_written_ = 0u;
+}
+
+StateStore::Record StateStore::capture() const {
+  Record record;
+  record.position_cdeg = mask_controller_->getPositionCdeg(false);
+  record.has_index = index_task_->getIndex(&record.index_cdeg,
+      &record.forward_edge_cdeg);
+  if (!record.has_index) {
+    record.index_cdeg = 0;
+    record.forward_edge_cdeg = 0;
+  }
+  record.backlash_cdeg = mask_controller_->getBacklash();
+  record.mask_teeth = mask_controller_->getMaskTeeth();
+  record.motor_teeth = mask_controller_->getMotorTeeth();
+  record.motor_phase = static_cast<uint8_t>(stepper_->getPhase());
+  return record;
+}
+
+void StateStore::encode(const uint8_t sequence, const Record& record) {
+  const int32_t words[] = {record.position_cdeg, record.index_cdeg,
+      record.forward_edge_cdeg, record.backlash_cdeg,
+      record.mask_teeth, record.motor_teeth};
+  const uint8_t widths[] = {4u, 4u, 4u, 4u, 2u, 2u};
+  image_[0] = sequence;
+  uint8_t offset = 1u;
+  for (uint8_t i = 0u; i < sizeof(widths); ++i) {
+    // Little-endian.
+    for (uint8_t byte = 0u; byte < widths[i]; ++byte) {
+      image_[offset++] =
+          static_cast<uint8_t>(static_cast<uint32_t>(words[i]) >> (8u * byte));
+    }
+  }
+  image_[offset++] = record.has_index ? 1u : 0u;
+  image_[offset] = record.motor_phase;
+  image_[CHECKSUM_OFFSET] = checksum();
+}
+
+void StateStore::decode(Record* const record) const {
+  int32_t words[6];
+  const uint8_t widths[] = {4u, 4u, 4u, 4u, 2u, 2u};
+  uint8_t offset = 1u;
+  for (uint8_t i = 0u; i < sizeof(widths); ++i) {
+    uint32_t word = 0u;
+    for (uint8_t byte = 0u; byte < widths[i]; ++byte) {
+      word |= static_cast<uint32_t>(image_[offset++]) << (8u * byte);
+    }
+    // Sign-extend the 16-bit fields.
+    words[i] = widths[i] == 2u ? static_cast<int16_t>(word) :
+        static_cast<int32_t>(word);
+  }
+  record->position_cdeg = words[0];
+  record->index_cdeg = words[1];
+  record->forward_edge_cdeg = words[2];
+  record->backlash_cdeg = words[3];
+  record->mask_teeth = static_cast<int16_t>(words[4]);
+  record->motor_teeth = static_cast<int16_t>(words[5]);
+  record->has_index = image_[offset++] != 0u;
+  record->motor_phase = image_[offset];
+}
+
+uint8_t StateStore::checksum() const {
+  // CRC-8 with polynomial 0x07. Starting from 0xff keeps both erased and
+  // zeroed slots from passing.
+  uint8_t crc = 0xffu;
+  for (uint8_t i = 0u; i < CHECKSUM_OFFSET; ++i) {
+    crc ^= image_[i];
+    for (uint8_t bit = 0u; bit < 8u; ++bit) {
+      crc = (crc & 0x80u) ? static_cast<uint8_t>((crc << 1) ^ 0x07u) :
+          static_cast<uint8_t>(crc << 1);
+    }
+  }
+  return crc;
+}
+
+bool StateStore::writeByte(const uint16_t address, const uint8_t value) {
+#if defined(__AVR__)
+  // A write takes about 3.4 ms; don't wait for the last one to finish.
+  if (!eeprom_is_ready()) {
+    return false;
+  }
+#endif
+  EEPROM.update(address, value);
+  return true;
+}
+
+uint16_t StateStore::slotAddress(const uint8_t slot) {
+  return BASE_ADDRESS + static_cast<uint16_t>(slot) * SLOT_SIZE;
+}
+
+bool StateStore::isSame(const Record& a, const Record& b) {
+  return a.position_cdeg == b.position_cdeg &&
+      a.index_cdeg == b.index_cdeg &&
+      a.forward_edge_cdeg == b.forward_edge_cdeg &&
+      a.backlash_cdeg == b.backlash_cdeg &&
+      a.mask_teeth == b.mask_teeth && a.motor_teeth == b.motor_teeth &&
+      a.has_index == b.has_index && a.motor_phase == b.motor_phase;
+}
@@ -0,0 +1,161 @@
+#ifndef STATE_STORE_H_
+#define STATE_STORE_H_
+
+#include "bipolar_stepper.h"
+#include "index_task.h"
+#include "mask_controller.h"
+#include <Arduino.h>  // For int16_t, int32_t, uint8_t, uint16_t
+
+// Operates a cooperative task that keeps the mask's position and calibration
+// in EEPROM, so that a restart needn't be followed by a fresh index search
+// if the mask hasn't been moved in the meantime.
+//
+// Records are written to a ring of slots, each new record in the slot after
+// the last, so that wear is spread across NUM_SLOTS slots. A record is only
+// written once the mask has been at rest for REST_MS, and one byte is written
+// per call to step(), and only when the EEPROM is ready for it, so that the
+// caller never waits. As soon as the mask moves, the newest record's position
+// is flagged as stale; the flag is set again once the mask comes to rest. A
+// record cut short by a loss of power fails its checksum, leaving the one
+// before it in force. Its sequence number is written last, so one that
+// passes by chance still carries an older number and is passed over.
+class StateStore {
+ public:
+  // What is kept across restarts.
+  struct Record {
+    int32_t position_cdeg;      // Mask position at rest [cdeg].
+    int32_t index_cdeg;         // Angle of the index [cdeg].
+    int32_t forward_edge_cdeg;  // First transition from the index [cdeg].
+    int32_t backlash_cdeg;      // Backlash of the drive train [cdeg].
+    int16_t mask_teeth;         // Gearing the angles were recorded with.
+    int16_t motor_teeth;
+    bool has_index;             // Whether index_cdeg has been found.
+    uint8_t motor_phase;        // Phase the motor was left in [microsteps].
+  };
+
+  // Outcomes of restoring from EEPROM.
+  enum class Restored : int {
+    NOTHING = 0,  // No usable record was found.
+    CALIBRATION,  // Calibration only; the mask may have moved since.
+    POSITION      // Calibration, position and any index.
+  };
+
+  // First EEPROM address used.
+  static const uint16_t BASE_ADDRESS = 0u;
+
+  // Number of slots records rotate through.
+  static const uint8_t NUM_SLOTS = 32u;
+
+  // Time the mask must be at rest before its position is saved [ms].
+  static const uint16_t REST_MS = 1000u;
+
+  // Constructs a new StateStore, designating the MaskController, IndexTask
+  // and BipolarStepper whose state it keeps.
+  //
+  // mask_controller: The MaskController to save and restore.
+  // index_task: The IndexTask to save and restore.
+  // stepper: The BipolarStepper driving the mask, whose phase is kept.
+  StateStore(MaskController* mask_controller, IndexTask* index_task,
+      BipolarStepper* stepper);
+
+  // Reads the newest record from EEPROM and applies it. Records made with
+  // different gearing are ignored. The position and index are only applied if
+  // the mask was at rest when power was lost, and if the motor's phase can be
+  // restored too, so that the rotor holds still when first energized; the
+  // mask's zero is offset so that it reads the saved position. Call this
+  // once, before the BipolarStepper is initialized and before the mask first
+  // moves; nothing is saved until it has been called.
+  //
+  // Returns: What was restored.
+  Restored restore();
+
+  // Saves the state when it has changed and the mask is at rest, and marks
+  // the saved position stale when the mask moves. Call this as frequently as
+  // possible.
+  void step();
+
+ private:
+  // Size of a slot: sequence number, encoded record, checksum and flag
+  // [bytes].
+  static const uint8_t SLOT_SIZE = 25u;
+
+  // Offsets of the checksum and flag within a slot [bytes].
+  static const uint8_t CHECKSUM_OFFSET = SLOT_SIZE - 2u;
+  static const uint8_t FLAG_OFFSET = SLOT_SIZE - 1u;
+
+  // Flag values marking a record's position as current or stale. A flag never
+  // written reads as neither.
+  static const uint8_t POSITION_CURRENT = 0xa5u;
+  static const uint8_t POSITION_STALE = 0x00u;
+
+  // Gathers the state to save.
+  //
+  // Returns: The current state.
+  Record capture() const;
+
+  // Encodes a record into the slot image, after the sequence number, and
+  // computes its checksum.
+  //
+  // sequence: Sequence number of the record.
+  // record: The record to encode.
+  void encode(uint8_t sequence, const Record& record);
+
+  // Decodes a record from the slot image.
+  //
+  // record: Filled with the decoded record.
+  void decode(Record* record) const;
+
+  // Computes the checksum of the slot image.
+  //
+  // Returns: CRC-8 of the sequence number and encoded record.
+  uint8_t checksum() const;
+
+  // Writes a byte to EEPROM if it is ready for one.
+  //
+  // address: The address to write.
+  // value: The byte to write there.
+  // Returns: True if the byte was written or already held that value, or
+  //          false if the EEPROM is still busy.
+  static bool writeByte(uint16_t address, uint8_t value);
+
+  // Computes the address of a slot.
+  //
+  // slot: Index of the slot.
+  // Returns: EEPROM address of the slot's first byte.
+  static uint16_t slotAddress(uint8_t slot);
+
+  // Checks whether two records hold the same state.
+  //
+  // a, b: The records to compare.
+  // Returns: True if every field matches.
+  static bool isSame(const Record& a, const Record& b);
+
+  // The MaskController, IndexTask and BipolarStepper whose state is kept.
+  MaskController* const mask_controller_;
+  IndexTask* const index_task_;
+  BipolarStepper* const stepper_;
+
+  // Whether restore() has been called.
+  bool is_restored_;
+
+  // The newest complete record, its slot and sequence number, whether there
+  // is one, and whether its position is flagged as current.
+  Record stored_;
+  uint8_t stored_slot_;
+  uint8_t stored_sequence_;
+  bool has_stored_;
+  bool stored_current_;
+
+  // When the mask was last seen moving [ms].
+  unsigned long last_motion_ms_;
+
+  // Image of the slot being written or read, the record it holds, the slot
+  // it is going to, and the number of its bytes written so far (SLOT_SIZE
+  // when not writing).
+  uint8_t image_[SLOT_SIZE];
+  Record pending_;
+  uint8_t pending_slot_;
+  uint8_t bytes_written_;
+};
+
+#endif
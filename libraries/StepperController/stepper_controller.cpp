@@ -1,65 +1,480 @@
 #include "stepper_controller.h"
 #include "bipolar_stepper.h"
 #include <Arduino.h>
-#include <Math.h>
 
 StepperController::StepperController(BipolarStepper* const stepper,
-    const int steps_per_rotation) : stepper_(stepper),
-    steps_per_rotation_(steps_per_rotation), position_steps_(0),
-    target_deg_(0.0f), target_steps_(0), behavior_(Behavior::STOPPED) {}
+    const int16_t steps_per_rotation) :
+    stepper_(stepper), full_steps_per_rotation_(steps_per_rotation),
+    steps_per_rotation_(stepper != nullptr ?
+        steps_per_rotation * stepper->getStepsPerFullStep() :
+        steps_per_rotation),
+    position_steps_(0), zero_offset_steps_(0), target_cdeg_(0),
+    target_steps_(0), behavior_(Behavior::STOPPED), step_count_(0u),
+    pending_events_(0u), update_sequence_(0u),
+    start_speed_sps_(DEFAULT_SPEED_SPS), cruise_speed_sps_(DEFAULT_SPEED_SPS),
+    acceleration_sps2_(0u), profile_(Profile::CONSTANT),
+    move_profile_(Profile::CONSTANT), has_pending_target_(false),
+    pending_target_steps_(0), pending_profile_(Profile::CONSTANT),
+    last_direction_(0), ramp_steps_(0u),
+    ramp_limit_steps_(0u), ramp_top_sps_(DEFAULT_SPEED_SPS),
+    step_interval_us_(1000000ul / DEFAULT_SPEED_SPS),
+    move_dwell_us_(0u), dwell_remaining_us_(0u), settling_(false),
+    settle_remaining_us_(0u), since_arrival_us_(0u), velocity_target_q20_(0),
+    velocity_q20_(0), velocity_wait_us_(0u), velocity_period_us_(0u),
+    velocity_carry_(0u), queue_head_(0u),
+    queue_tail_(0u), idle_(true), wake_callback_(nullptr),
+    settle_callback_(nullptr), departure_callback_(nullptr),
+    release_callback_(nullptr) {}
 
 void StepperController::forward() volatile {
+  flushQueue();
+  leaveArrival();
+  behavior_ = Behavior::STOPPED;
+  move_profile_ = Profile::CONSTANT;
+  ramp_steps_ = 0u;
+  ramp_limit_steps_ = 0u;
+  step_interval_us_ = rampIntervalUs(0u);
   behavior_ = Behavior::FORWARD;
+  postEvents(EVENT_MOVE_STARTED);
+  wake();
 }
 
 void StepperController::reverse() volatile {
+  flushQueue();
+  leaveArrival();
+  behavior_ = Behavior::STOPPED;
+  move_profile_ = Profile::CONSTANT;
+  ramp_steps_ = 0u;
+  ramp_limit_steps_ = 0u;
+  step_interval_us_ = rampIntervalUs(0u);
   behavior_ = Behavior::REVERSE;
+  postEvents(EVENT_MOVE_STARTED);
+  wake();
 }
 
 void StepperController::stop() volatile {
+  flushQueue();
+  const Behavior previous_behavior = behavior_;
   behavior_ = Behavior::STOPPED;
+  if (previous_behavior != Behavior::STOPPED &&
+      previous_behavior != Behavior::REACHED_TARGET) {
+    postEvents(EVENT_STOPPED);
+  }
 }
 
-float StepperController::rotateTo(const float target_deg) volatile {
-  // Very brief pause to avoid potential momentary direction change.
+void StepperController::setVelocity(int32_t steps_per_s_q20) volatile {
+  // Keep the magnitude representable.
+  if (steps_per_s_q20 < -0x7FFFFFFFL) {
+    steps_per_s_q20 = -0x7FFFFFFFL;
+  }
+  // Check and update together so that update() can't stop the motor between
+  // the two and strand the new rate.
+  noInterrupts();
+  const bool running = behavior_ == Behavior::VELOCITY;
+  if (running) {
+    velocity_target_q20_ = steps_per_s_q20;
+  }
+  interrupts();
+  if (running) {
+    return;
+  }
+
+  flushQueue();
+  leaveArrival();
   behavior_ = Behavior::STOPPED;
-  target_deg_ = target_deg;
-  target_steps_ = degreesToSteps(target_deg_);
-  behavior_ = Behavior::TARGETING;
-  return stepsToDegrees(target_steps_);
+  velocity_target_q20_ = steps_per_s_q20;
+  velocity_q20_ = 0;
+  velocity_wait_us_ = 0u;
+  velocity_period_us_ = 0u;
+  velocity_carry_ = 0u;
+  step_interval_us_ = rampIntervalUs(0u);
+  behavior_ = Behavior::VELOCITY;
+  postEvents(EVENT_MOVE_STARTED);
+  wake();
+}
+
+int32_t StepperController::getVelocity() const volatile {
+  return velocity_target_q20_;
+}
+
+int32_t StepperController::rotateTo(const int32_t target_cdeg) volatile {
+  return rotateTo(target_cdeg, profile_);
 }
 
-float StepperController::rotateBy(const float angle_deg) volatile {
-  // Very brief pause to avoid position changes.
+int32_t StepperController::rotateTo(const int32_t target_cdeg,
+    const Profile profile) volatile {
+  const int32_t target_steps = centidegreesToSteps(target_cdeg);
+  beginMove(target_steps, target_cdeg, profile);
+  return stepsToCentidegrees(target_steps);
+}
+
+int32_t StepperController::rotateToSteps(const int32_t target_steps,
+    const Profile profile) volatile {
+  beginMove(target_steps, stepsToCentidegrees(target_steps), profile);
+  return target_steps;
+}
+
+void StepperController::beginMove(const int32_t target_steps,
+    const int32_t target_cdeg, const Profile profile) volatile {
+  // The queue is flushed first so that update() can't start a queued move
+  // meanwhile.
+  flushQueue();
+  leaveArrival();
+
+  // Decide whether to blend and act on it in one go, so that update() can't
+  // step or finish the move in between.
+  noInterrupts();
+  const bool leaving_velocity = behavior_ == Behavior::VELOCITY;
+  if (leaving_velocity) {
+    leaveVelocity();
+  }
+  if (behavior_ == Behavior::TARGETING && ramp_steps_ > 0u &&
+      position_steps_ != target_steps_) {
+    const int32_t direction = target_steps_ > position_steps_ ? 1 : -1;
+    // Decelerating takes as many steps as we've accelerated by.
+    const int32_t stop_steps = position_steps_ +
+        direction * static_cast<int32_t>(ramp_steps_);
+    target_cdeg_ = target_cdeg;
+    move_dwell_us_ = 0u;
+    // Only a ramp of the same profile can be carried on with; anything else
+    // halts first, so that the speed never drops more than a ramp allows.
+    if (!leaving_velocity && profile == move_profile_ &&
+        (target_steps - stop_steps) * direction >= 0) {
+      // Still ahead of us; carry on at the present speed.
+      target_steps_ = target_steps;
+      has_pending_target_ = false;
+    } else {
+      // Slow to a halt along the present ramp, then head for the target.
+      target_steps_ = stop_steps;
+      pending_target_steps_ = target_steps;
+      pending_profile_ = profile;
+      has_pending_target_ = true;
+    }
+    interrupts();
+    postEvents(EVENT_MOVE_STARTED);
+    return;
+  }
+  interrupts();
+
+  // At rest or no faster than the start speed, so we can set off at once.
   behavior_ = Behavior::STOPPED;
-  target_deg_ = stepsToDegrees(position_steps_) + angle_deg;
-  target_steps_ = degreesToSteps(target_deg_);
+  target_cdeg_ = target_cdeg;
+  target_steps_ = target_steps;
+  planMove(profile);
+  move_dwell_us_ = 0u;
   behavior_ = Behavior::TARGETING;
-  return target_deg_;
+  postEvents(EVENT_MOVE_STARTED);
+  wake();
+}
+
+int32_t StepperController::rotateBy(const int32_t angle_cdeg) volatile {
+  return rotateBy(angle_cdeg, profile_);
+}
+
+int32_t StepperController::rotateBy(const int32_t angle_cdeg,
+    const Profile profile) volatile {
+  const int32_t target_cdeg =
+      stepsToCentidegrees(getSnapshot().position_steps) + angle_cdeg;
+  beginMove(centidegreesToSteps(target_cdeg), target_cdeg, profile);
+  return target_cdeg;
+}
+
+bool StepperController::enqueueMove(const int32_t target_cdeg,
+    const Profile profile, const uint16_t dwell_ms) volatile {
+  return enqueueMoveSteps(centidegreesToSteps(target_cdeg), profile,
+      dwell_ms);
+}
+
+bool StepperController::enqueueMoveSteps(const int32_t target_steps,
+    const Profile profile, const uint16_t dwell_ms) volatile {
+  if (getQueuedMoveCount() >= MOTION_QUEUE_LENGTH) {
+    return false;
+  }
+  // Continuous motion never hands over to the queue, and stopping or
+  // changing it flushes the queue, so a move queued now would be lost.
+  const Behavior behavior = behavior_;
+  if (behavior == Behavior::FORWARD || behavior == Behavior::REVERSE ||
+      behavior == Behavior::VELOCITY) {
+    return false;
+  }
+
+  // Fill the slot before publishing it by advancing the tail.
+  volatile QueuedMove& move =
+      queue_[queue_tail_ & (MOTION_QUEUE_LENGTH - 1u)];
+  move.target_steps = target_steps;
+  move.dwell_ms = dwell_ms;
+  move.profile = profile;
+  queue_tail_++;
+
+  // The timer only needs restarting if update() has already gone idle, in
+  // which case it can't be running to race with us here.
+  if (idle_) {
+    step_interval_us_ = rampIntervalUs(0u);
+  }
+  wake();
+  return true;
+}
+
+uint32_t StepperController::estimateMoveUs(const int32_t displacement_steps,
+    const Profile profile, const uint32_t backlash_steps) const volatile {
+  // Present speed and direction of travel, the acceleration the motor would
+  // slow down at, and whether the move could carry on without halting.
+  uint32_t speed_sps = 0u;
+  int8_t direction = 0;
+  uint32_t stop_acceleration_sps2 = 0u;
+  bool can_blend = false;
+  noInterrupts();
+  const int8_t last_direction = last_direction_;
+  switch (behavior_) {
+    default:
+    case Behavior::STOPPED:
+    case Behavior::REACHED_TARGET:
+      break;
+    case Behavior::FORWARD:
+    case Behavior::REVERSE:
+    case Behavior::TARGETING:
+      direction = behavior_ == Behavior::FORWARD ? 1 :
+          behavior_ == Behavior::REVERSE ? -1 :
+          target_steps_ > position_steps_ ? 1 :
+          target_steps_ < position_steps_ ? -1 : 0;
+      speed_sps = direction != 0 ? 1000000ul / step_interval_us_ : 0u;
+      if (behavior_ == Behavior::TARGETING) {
+        stop_acceleration_sps2 = profileAccelerationSps2(move_profile_);
+        can_blend = profile == move_profile_;
+      }
+      break;
+    case Behavior::VELOCITY: {
+      direction = velocity_q20_ > 0 ? 1 : velocity_q20_ < 0 ? -1 : 0;
+      const uint32_t rate_q20 = velocity_q20_ >= 0 ? velocity_q20_ :
+          -velocity_q20_;
+      speed_sps = rate_q20 / VELOCITY_SCALE;
+      stop_acceleration_sps2 = acceleration_sps2_;
+      break;
+    }
+  }
+  interrupts();
+
+  const uint32_t acceleration_sps2 = profileAccelerationSps2(profile);
+
+  // Distance and time needed to slow from the present speed to the start
+  // speed, from which the motor can halt at once.
+  uint32_t stop_steps = 0u;
+  uint32_t stop_us = 0u;
+  if (speed_sps > start_speed_sps_ && stop_acceleration_sps2 > 0u) {
+    stop_steps = static_cast<uint32_t>((static_cast<uint64_t>(speed_sps) *
+        speed_sps - static_cast<uint64_t>(start_speed_sps_) *
+        start_speed_sps_) /
+        (2u * static_cast<uint64_t>(stop_acceleration_sps2)));
+    stop_us = static_cast<uint32_t>(
+        static_cast<uint64_t>(speed_sps - start_speed_sps_) * 1000000u /
+        stop_acceleration_sps2);
+  }
+
+  const int8_t heading = displacement_steps > 0 ? 1 :
+      displacement_steps < 0 ? -1 : 0;
+  const uint32_t distance_steps = displacement_steps >= 0 ?
+      displacement_steps : -displacement_steps;
+  if (direction == 0) {
+    // From rest. Slack is taken up when setting off the other way from the
+    // last step.
+    const bool reversing = heading != 0 && last_direction != 0 &&
+        heading != last_direction;
+    return estimateTravelUs(distance_steps + (reversing ? backlash_steps : 0u),
+        start_speed_sps_, acceleration_sps2);
+  }
+  const bool ahead = heading == direction && distance_steps >= stop_steps;
+  if (ahead && can_blend) {
+    return estimateTravelUs(distance_steps, speed_sps, acceleration_sps2);
+  }
+  // Halt, then set off afresh: on towards the target, or back to one we
+  // overshot.
+  const uint32_t onward_steps = ahead ? distance_steps - stop_steps :
+      heading == direction ? stop_steps - distance_steps :
+      stop_steps + distance_steps;
+  const uint32_t onward_us = estimateTravelUs(
+      onward_steps + (ahead ? 0u : backlash_steps), start_speed_sps_,
+      acceleration_sps2);
+  return onward_us <= 0xFFFFFFFFul - stop_us ? stop_us + onward_us :
+      0xFFFFFFFFul;
 }
 
-float StepperController::getPositionDeg() const volatile {
-  // TODO: Disable interrupts here.
-  return stepsToDegrees(position_steps_);
+uint32_t StepperController::estimateRestMoveUs(const uint32_t distance_steps,
+    const Profile profile) const volatile {
+  return estimateTravelUs(distance_steps, start_speed_sps_,
+      profileAccelerationSps2(profile));
 }
 
-float StepperController::getTarget() const volatile {
-  return target_deg_;
+uint8_t StepperController::getQueuedMoveCount() const volatile {
+  return static_cast<uint8_t>(queue_tail_ - queue_head_);
+}
+
+uint8_t StepperController::flushQueue() volatile {
+  // Count and discard in one go so update() can't start a move in between.
+  noInterrupts();
+  const uint8_t discarded = getQueuedMoveCount();
+  queue_head_ = queue_tail_;
+  interrupts();
+  return discarded;
+}
+
+// update() runs to completion whenever it interrupts us, so if the sequence
+// number is unchanged after copying, nothing was modified partway through.
+StepperController::Snapshot StepperController::getSnapshot() const volatile {
+  Snapshot snapshot;
+  uint8_t sequence = 0u;
+  do {
+    sequence = update_sequence_;
+    snapshot.position_steps = position_steps_;
+    snapshot.target_steps = target_steps_;
+    snapshot.target_cdeg = target_cdeg_;
+    snapshot.behavior = behavior_;
+    snapshot.step_count = step_count_;
+  } while (sequence != update_sequence_);
+  return snapshot;
+}
+
+uint8_t StepperController::takeEvents() volatile {
+  noInterrupts();
+  const uint8_t events = pending_events_;
+  pending_events_ = 0u;
+  interrupts();
+  return events;
+}
+
+int32_t StepperController::getPositionCdeg() const volatile {
+  return stepsToCentidegrees(getSnapshot().position_steps);
+}
+
+int32_t StepperController::getTargetCdeg() const volatile {
+  return getSnapshot().target_cdeg;
 }
 
 void StepperController::setZero() volatile {
+  zero_offset_steps_ += position_steps_;
   position_steps_ = 0;
 }
 
-void StepperController::offsetZero(const float relative_angle_deg) volatile {
-  position_steps_ -= degreesToSteps(relative_angle_deg);
+void StepperController::offsetZero(const int32_t relative_angle_cdeg) volatile {
+  offsetZeroSteps(centidegreesToSteps(relative_angle_cdeg));
+}
+
+void StepperController::offsetZeroSteps(const int32_t relative_steps)
+    volatile {
+  zero_offset_steps_ += relative_steps;
+  position_steps_ -= relative_steps;
+}
+
+int32_t StepperController::getZeroOffsetSteps() const volatile {
+  return zero_offset_steps_;
+}
+
+void StepperController::setStartSpeed(const uint32_t steps_per_s) volatile {
+  if (steps_per_s < 1u) {
+    start_speed_sps_ = 1u;
+  } else if (steps_per_s > MAX_SPEED_SPS) {
+    start_speed_sps_ = MAX_SPEED_SPS;
+  } else {
+    start_speed_sps_ = steps_per_s;
+  }
+}
+
+void StepperController::setCruiseSpeed(const uint32_t steps_per_s) volatile {
+  cruise_speed_sps_ =
+      steps_per_s > MAX_SPEED_SPS ? MAX_SPEED_SPS : steps_per_s;
+}
+
+void StepperController::setAcceleration(const uint32_t steps_per_s2) volatile {
+  acceleration_sps2_ = steps_per_s2 > MAX_ACCELERATION_SPS2 ?
+      MAX_ACCELERATION_SPS2 : steps_per_s2;
+}
+
+void StepperController::setProfile(const Profile profile) volatile {
+  profile_ = profile;
+}
+
+uint16_t StepperController::getStartSpeed() const volatile {
+  return start_speed_sps_;
+}
+
+uint16_t StepperController::getCruiseSpeed() const volatile {
+  return cruise_speed_sps_;
+}
+
+uint32_t StepperController::getAcceleration() const volatile {
+  return acceleration_sps2_;
+}
+
+StepperController::Profile StepperController::getProfile() const volatile {
+  return profile_;
+}
+
+void StepperController::setStepMode(
+    const BipolarStepper::StepMode step_mode) volatile {
+  if (stepper_ == nullptr) {
+    return;
+  }
+
+  stop();
+  const int old_steps_per_full_step = stepper_->getStepsPerFullStep();
+  stepper_->setStepMode(step_mode);
+  const int new_steps_per_full_step = stepper_->getStepsPerFullStep();
+  if (new_steps_per_full_step == old_steps_per_full_step) {
+    return;
+  }
+
+  steps_per_rotation_ = full_steps_per_rotation_ * new_steps_per_full_step;
+  position_steps_ = rescaleSteps(position_steps_, old_steps_per_full_step,
+      new_steps_per_full_step);
+  zero_offset_steps_ = rescaleSteps(zero_offset_steps_,
+      old_steps_per_full_step, new_steps_per_full_step);
+  target_steps_ = rescaleSteps(target_steps_, old_steps_per_full_step,
+      new_steps_per_full_step);
+  setStartSpeed(static_cast<uint32_t>(start_speed_sps_) *
+      new_steps_per_full_step / old_steps_per_full_step);
+  setCruiseSpeed(static_cast<uint32_t>(cruise_speed_sps_) *
+      new_steps_per_full_step / old_steps_per_full_step);
+  setAcceleration(acceleration_sps2_ * new_steps_per_full_step /
+      old_steps_per_full_step);
+}
+
+BipolarStepper::StepMode StepperController::getStepMode() const volatile {
+  return stepper_ != nullptr ? stepper_->getStepMode() :
+      BipolarStepper::StepMode::FULL_STEP;
+}
+
+int16_t StepperController::getStepsPerRotation() const volatile {
+  return steps_per_rotation_;
+}
+
+void StepperController::setWakeCallback(
+    void (*const cb)(uint32_t period_us)) volatile {
+  wake_callback_ = cb;
+}
+
+void StepperController::setSettleCallback(
+    uint32_t (*const cb)(uint32_t since_arrival_us)) volatile {
+  settle_callback_ = cb;
+}
+
+void StepperController::setDepartureCallback(bool (*const cb)()) volatile {
+  departure_callback_ = cb;
+}
+
+void StepperController::setReleaseCallback(void (*const cb)()) volatile {
+  release_callback_ = cb;
+}
+
+bool StepperController::isIdle() const volatile {
+  return idle_;
 }
 
 // Note: Instead of a switch tree, we could set a function pointer (to a private
 // helper function) whenever we alter behavior_. Snazzy but probably overkill.
-void StepperController::update() volatile {
+uint32_t StepperController::update() volatile {
+  update_sequence_++;
   if (stepper_ == nullptr) {
-    return;
+    idle_ = true;
+    return 0u;
   }
 
   switch (behavior_) {
@@ -70,29 +485,471 @@ void StepperController::update() volatile {
     case Behavior::FORWARD:
       stepper_->stepForward();
       position_steps_++;
-      break;
+      step_count_++;
+      last_direction_ = 1;
+      return step_interval_us_;
     case Behavior::REVERSE:
       stepper_->stepBackward();
       position_steps_--;
-      break;
-    case Behavior::TARGETING:
+      step_count_++;
+      last_direction_ = -1;
+      return step_interval_us_;
+    case Behavior::TARGETING: {
+      uint32_t remaining_steps = 0u;
       if (position_steps_ < target_steps_) {
         stepper_->stepForward();
         position_steps_++;
+        step_count_++;
+        last_direction_ = 1;
+        remaining_steps = target_steps_ - position_steps_;
       } else if (position_steps_ > target_steps_) {
         stepper_->stepBackward();
         position_steps_--;
-      } else /*position_steps_ == target_steps_*/ {
+        step_count_++;
+        last_direction_ = -1;
+        remaining_steps = position_steps_ - target_steps_;
+      }
+      if (remaining_steps == 0u && has_pending_target_ &&
+          pending_target_steps_ != position_steps_) {
+        // Halted on the way to a target we'd overshot; head back for it.
+        target_steps_ = pending_target_steps_;
+        planMove(pending_profile_);
+        return step_interval_us_;
+      }
+      if (remaining_steps == 0u) {
         behavior_ = Behavior::REACHED_TARGET;
+        pending_events_ |= EVENT_TARGET_REACHED;
+        dwell_remaining_us_ = move_dwell_us_;
+        settling_ = settle_callback_ != nullptr;
+        settle_remaining_us_ = 0u;
+        since_arrival_us_ = 0u;
+        break;
+      }
+      advanceRamp(remaining_steps);
+      return step_interval_us_;
+    }
+    case Behavior::VELOCITY: {
+      const uint32_t period_us = updateVelocity();
+      if (period_us > 0u) {
+        return period_us;
       }
       break;
+    }
+  }
+
+  // Only STOPPED and REACHED_TARGET get here. Hold at the target for the
+  // move's dwell time and until the settle callback is done, then carry on
+  // with the next queued move if any.
+  if (behavior_ == Behavior::REACHED_TARGET) {
+    if (settling_ && settle_remaining_us_ == 0u) {
+      settle_remaining_us_ = settle_callback_ != nullptr ?
+          settle_callback_(since_arrival_us_) : 0u;
+      settling_ = settle_remaining_us_ > 0u;
+    }
+    if (dwell_remaining_us_ > 0u || settling_) {
+      uint32_t period_us = MAX_DWELL_PERIOD_US;
+      if (dwell_remaining_us_ > 0u && dwell_remaining_us_ < period_us) {
+        period_us = dwell_remaining_us_;
+      }
+      if (settling_ && settle_remaining_us_ < period_us) {
+        period_us = settle_remaining_us_;
+      }
+      dwell_remaining_us_ -= dwell_remaining_us_ < period_us ?
+          dwell_remaining_us_ : period_us;
+      if (settling_) {
+        settle_remaining_us_ -= period_us;
+      }
+      since_arrival_us_ += period_us;
+      return period_us;
+    }
+  }
+  if (queue_head_ != queue_tail_ && departure_callback_ != nullptr &&
+      !departure_callback_()) {
+    return GATE_POLL_PERIOD_US;
+  }
+  if (startQueuedMove()) {
+    return step_interval_us_;
+  }
+
+  idle_ = true;
+  return 0u;
+}
+
+// Whole rotations are split off before scaling so that the intermediate product
+// stays within 32 bits for any representable angle.
+int32_t StepperController::centidegreesToSteps(const int32_t centidegrees) const
+    volatile {
+  const int32_t rotations = centidegrees / CENTIDEGREES_PER_ROTATION;
+  const int32_t remainder_cdeg = centidegrees % CENTIDEGREES_PER_ROTATION;
+  return rotations * steps_per_rotation_ + roundedDivide(
+      remainder_cdeg * steps_per_rotation_, CENTIDEGREES_PER_ROTATION);
+}
+
+int32_t StepperController::stepsToCentidegrees(const int32_t steps) const
+    volatile {
+  const int32_t rotations = steps / steps_per_rotation_;
+  const int32_t remainder_steps = steps % steps_per_rotation_;
+  return rotations * CENTIDEGREES_PER_ROTATION + roundedDivide(
+      remainder_steps * CENTIDEGREES_PER_ROTATION, steps_per_rotation_);
+}
+
+int32_t StepperController::roundedDivide(const int32_t numerator,
+    const int32_t denominator) {
+  // Rounds half away from zero, like round(). Denominator must be positive.
+  return numerator >= 0 ? (numerator + denominator / 2) / denominator :
+      -((-numerator + denominator / 2) / denominator);
+}
+
+bool StepperController::startQueuedMove() volatile {
+  if (queue_head_ == queue_tail_) {
+    return false;
+  }
+
+  const volatile QueuedMove& move =
+      queue_[queue_head_ & (MOTION_QUEUE_LENGTH - 1u)];
+  target_steps_ = move.target_steps;
+  target_cdeg_ = stepsToCentidegrees(target_steps_);
+  planMove(move.profile);
+  move_dwell_us_ = move.dwell_ms * 1000ul;
+  // Release the slot only once we're done reading it.
+  queue_head_++;
+  behavior_ = Behavior::TARGETING;
+  pending_events_ |= EVENT_MOVE_STARTED;
+  return true;
+}
+
+void StepperController::planMove(const Profile profile) volatile {
+  move_profile_ = profile;
+  has_pending_target_ = false;
+  ramp_steps_ = 0u;
+  ramp_limit_steps_ = 0u;
+  ramp_top_sps_ = cruise_speed_sps_ > start_speed_sps_ ? cruise_speed_sps_ :
+      start_speed_sps_;
+  if (acceleration_sps2_ == 0u || cruise_speed_sps_ <= start_speed_sps_) {
+    // Nothing to ramp between.
+  } else if (profile == Profile::TRAPEZOIDAL) {
+    // Steps needed to reach cruise speed: v^2 = v0^2 + 2*a*n. The squares
+    // fit easily, as both speeds are at most MAX_SPEED_SPS.
+    const uint32_t cruise_sq = static_cast<uint32_t>(cruise_speed_sps_) *
+        cruise_speed_sps_;
+    const uint32_t start_sq = static_cast<uint32_t>(start_speed_sps_) *
+        start_speed_sps_;
+    ramp_limit_steps_ = (cruise_sq - start_sq) / (2u * acceleration_sps2_);
+  } else if (profile == Profile::S_CURVE) {
+    // Speed follows a smoothstep over the ramp distance, whose steepest slope
+    // is 1.5 * (v - v0) / n. Stretch the ramp so the peak acceleration, v times
+    // that slope, stays within the configured acceleration. The product is
+    // bounded by the speed clamp; make sure raising it can't overflow it.
+    static_assert(3ull * MAX_SPEED_SPS * MAX_SPEED_SPS <= 0xFFFFFFFFull,
+        "S-curve ramp length overflows at MAX_SPEED_SPS");
+    const uint32_t stretched_steps = 3ul * cruise_speed_sps_ *
+        (cruise_speed_sps_ - start_speed_sps_) / (2u * acceleration_sps2_);
+    ramp_limit_steps_ = stretched_steps < MAX_S_CURVE_RAMP_STEPS ?
+        stretched_steps : MAX_S_CURVE_RAMP_STEPS;
+  }
+  step_interval_us_ = rampIntervalUs(0u);
+}
+
+// A trapezoidal ramp that has climbed to the present rate decelerates just as
+// velocity mode would, so hand over to one and halt at its end.
+void StepperController::leaveVelocity() volatile {
+  const int32_t direction = velocity_q20_ >= 0 ? 1 : -1;
+  const uint32_t rate_q20 = velocity_q20_ >= 0 ? velocity_q20_ :
+      -velocity_q20_;
+  const uint16_t speed_sps = rate_q20 / VELOCITY_SCALE;
+  move_profile_ = Profile::TRAPEZOIDAL;
+  has_pending_target_ = false;
+  ramp_steps_ = 0u;
+  if (speed_sps > start_speed_sps_ && acceleration_sps2_ != 0u) {
+    ramp_steps_ = (static_cast<uint32_t>(speed_sps) * speed_sps -
+        static_cast<uint32_t>(start_speed_sps_) * start_speed_sps_) /
+        (2u * acceleration_sps2_);
+  }
+  ramp_limit_steps_ = ramp_steps_;
+  ramp_top_sps_ = speed_sps > start_speed_sps_ ? speed_sps : start_speed_sps_;
+  target_steps_ = position_steps_ +
+      direction * static_cast<int32_t>(ramp_steps_);
+  step_interval_us_ = rampIntervalUs(ramp_steps_);
+  behavior_ = Behavior::TARGETING;
+}
+
+// Settling is cleared before releasing, so that update() can't begin anything
+// new for the callback to end once it has been called.
+void StepperController::leaveArrival() volatile {
+  settling_ = false;
+  if (release_callback_ != nullptr) {
+    release_callback_();
+  }
+}
+
+// Interrupts are held off only for the read-modify-write itself, which update()
+// could otherwise interleave with and lose its own events.
+void StepperController::postEvents(const uint8_t events) volatile {
+  noInterrupts();
+  pending_events_ |= events;
+  interrupts();
+}
+
+void StepperController::wake() volatile {
+  if (!idle_) {
+    return;
+  }
+  idle_ = false;
+  // The first step comes one interval after the request, as though the motor
+  // had just stepped at the start speed.
+  if (wake_callback_ != nullptr) {
+    wake_callback_(step_interval_us_);
   }
 }
 
-int32_t StepperController::degreesToSteps(const float degrees) const volatile {
-  return static_cast<int32_t>(round(degrees / 360.0f * steps_per_rotation_));
+uint32_t StepperController::updateVelocity() volatile {
+  const int32_t previous_q20 = velocity_q20_;
+  rampVelocity(velocity_period_us_);
+  if (velocity_q20_ == 0 && velocity_target_q20_ == 0) {
+    behavior_ = Behavior::STOPPED;
+    pending_events_ |= EVENT_STOPPED;
+    return 0u;
+  }
+
+  if (velocity_wait_us_ == 0u) {
+    // A step is due, in the direction we were going while it came due.
+    if (previous_q20 > 0) {
+      stepper_->stepForward();
+      position_steps_++;
+      step_count_++;
+      last_direction_ = 1;
+    } else if (previous_q20 < 0) {
+      stepper_->stepBackward();
+      position_steps_--;
+      step_count_++;
+      last_direction_ = -1;
+    }
+    velocity_wait_us_ = velocityIntervalUs();
+  } else if (velocity_q20_ != previous_q20) {
+    if (previous_q20 == 0 || (previous_q20 > 0) != (velocity_q20_ > 0)) {
+      // Starting out or reversing: begin a fresh step.
+      velocity_carry_ = 0u;
+      velocity_wait_us_ = velocityIntervalUs();
+    } else {
+      // Keep the fraction of the step already covered. This only happens
+      // when steps are further apart than MAX_VELOCITY_PERIOD_US. A wait
+      // times the rate it was set at is at most about 2^40, so dropping up to
+      // 8 low bits of the wait, 256 us, lets the product fit in 32 bits.
+      const uint32_t previous_rate = previous_q20 > 0 ? previous_q20 :
+          -previous_q20;
+      const uint32_t rate = velocity_q20_ > 0 ? velocity_q20_ : -velocity_q20_;
+      const uint32_t max_wait_us = 0xFFFFFFFFul / previous_rate;
+      uint32_t wait_us = velocity_wait_us_;
+      uint8_t shift = 0u;
+      while (wait_us > max_wait_us) {
+        wait_us >>= 1;
+        shift++;
+      }
+      wait_us = wait_us * previous_rate / rate;
+      velocity_wait_us_ = wait_us <= (0xFFFFFFFFul >> shift) ?
+          wait_us << shift : 0xFFFFFFFFul;
+    }
+  }
+
+  velocity_period_us_ = velocity_wait_us_ < MAX_VELOCITY_PERIOD_US ?
+      velocity_wait_us_ : MAX_VELOCITY_PERIOD_US;
+  velocity_wait_us_ -= velocity_period_us_;
+  return velocity_period_us_;
+}
+
+void StepperController::rampVelocity(const uint32_t elapsed_us) volatile {
+  const int32_t target_q20 = velocity_target_q20_;
+  if (velocity_q20_ == target_q20) {
+    return;
+  }
+
+  // Change in rate over the elapsed time, a * t, scaled by VELOCITY_SCALE.
+  // The factor of 2^20 / 1000000 reduces to 16384 / 15625.
+  uint32_t change_q20 = 0xFFFFFFFFul;
+  if (acceleration_sps2_ != 0u && elapsed_us <= 0xFFFFFFFFul /
+      acceleration_sps2_) {
+    const uint32_t product = acceleration_sps2_ * elapsed_us;
+    if (product / 15625u < 0x40000ul) {
+      change_q20 = product / 15625u * 16384u +
+          product % 15625u * 16384u / 15625u;
+    }
+  }
+  // Compare gaps as unsigned values; the rates may be of opposite sign.
+  if (target_q20 > velocity_q20_) {
+    const uint32_t gap_q20 = static_cast<uint32_t>(target_q20) -
+        static_cast<uint32_t>(velocity_q20_);
+    velocity_q20_ = gap_q20 <= change_q20 ? target_q20 :
+        static_cast<int32_t>(static_cast<uint32_t>(velocity_q20_) +
+            change_q20);
+  } else {
+    const uint32_t gap_q20 = static_cast<uint32_t>(velocity_q20_) -
+        static_cast<uint32_t>(target_q20);
+    velocity_q20_ = gap_q20 <= change_q20 ? target_q20 :
+        static_cast<int32_t>(static_cast<uint32_t>(velocity_q20_) -
+            change_q20);
+  }
 }
 
-float StepperController::stepsToDegrees(const int32_t steps) const volatile {
-  return 360.0f * steps / steps_per_rotation_;
+// The interval is 2^20 * 1000000 / rate, whose dividend exceeds 32 bits, so
+// the division is finished off a bit at a time.
+uint32_t StepperController::velocityIntervalUs() volatile {
+  const uint32_t rate = velocity_q20_ > 0 ? velocity_q20_ : -velocity_q20_;
+  if (rate == 0u || 1000000ul / rate >= 0x1000ul) {
+    return 0xFFFFFFFFul;
+  }
+  uint32_t interval_us = 1000000ul / rate;
+  uint32_t remainder = 1000000ul % rate;
+  for (uint8_t bit = 0u; bit < 20u; ++bit) {
+    // The remainder is below the rate, which is below 2^31, so this fits.
+    remainder <<= 1;
+    interval_us <<= 1;
+    if (remainder >= rate) {
+      remainder -= rate;
+      interval_us |= 1u;
+    }
+  }
+
+  // Accumulate the fractional part so that the average interval is exact.
+  if (velocity_carry_ >= rate) {
+    // Left over from a faster rate; start afresh.
+    velocity_carry_ = 0u;
+  }
+  velocity_carry_ += remainder;
+  if (velocity_carry_ >= rate) {
+    velocity_carry_ -= rate;
+    interval_us++;
+  }
+  return interval_us;
+}
+
+// A smoothstep ramp spans 3 * vc * (vc - v0) / (2 * a) steps, which at a
+// constant acceleration would be a * (vc + v0) / (3 * vc).
+uint32_t StepperController::profileAccelerationSps2(const Profile profile)
+    const volatile {
+  if (acceleration_sps2_ == 0u || cruise_speed_sps_ <= start_speed_sps_ ||
+      profile == Profile::CONSTANT) {
+    return 0u;
+  }
+  if (profile == Profile::S_CURVE) {
+    return static_cast<uint32_t>(static_cast<uint64_t>(acceleration_sps2_) *
+        (cruise_speed_sps_ + start_speed_sps_) / (3ul * cruise_speed_sps_));
+  }
+  return acceleration_sps2_;
+}
+
+// With a constant acceleration a, reaching a peak speed vp from an entry speed
+// ve and coming back down to the start speed v0 over n steps requires
+// vp^2 = (2 * a * n + ve^2 + v0^2) / 2. Any distance left over is covered at
+// the peak speed.
+uint32_t StepperController::estimateTravelUs(const uint32_t distance_steps,
+    const uint32_t entry_sps, const uint32_t acceleration_sps2) const
+    volatile {
+  if (distance_steps == 0u) {
+    return 0u;
+  }
+  const uint64_t start_sps = start_speed_sps_;
+  uint64_t time_us = 0u;
+  if (acceleration_sps2 == 0u) {
+    time_us = distance_steps * 1000000ull / start_sps;
+  } else {
+    const uint64_t cruise_sps = cruise_speed_sps_;
+    const uint64_t entry = entry_sps < start_sps ? start_sps :
+        entry_sps > cruise_sps ? cruise_sps : entry_sps;
+    const uint64_t peak_sq = (2u * static_cast<uint64_t>(acceleration_sps2) *
+        distance_steps + entry * entry + start_sps * start_sps) / 2u;
+    uint64_t peak_sps = peak_sq >= cruise_sps * cruise_sps ? cruise_sps :
+        isqrt(static_cast<uint32_t>(peak_sq));
+    if (peak_sps < entry) {
+      peak_sps = entry;
+    }
+    const uint64_t ramp_steps = (2u * peak_sps * peak_sps - entry * entry -
+        start_sps * start_sps) / (2u * acceleration_sps2);
+    const uint64_t cruise_steps = distance_steps > ramp_steps ?
+        distance_steps - ramp_steps : 0u;
+    time_us = (2u * peak_sps - entry - start_sps) * 1000000u /
+        acceleration_sps2 + cruise_steps * 1000000u / peak_sps;
+  }
+  return time_us < 0xFFFFFFFFull ? static_cast<uint32_t>(time_us) :
+      0xFFFFFFFFul;
+}
+
+// Decelerating takes exactly as many steps as accelerating did, so ramp_steps_
+// doubles as the distance needed to stop. We start slowing down as soon as the
+// remaining distance no longer exceeds it, which lands the final step at the
+// start speed and can never carry us past the target.
+void StepperController::advanceRamp(const uint32_t remaining_steps) volatile {
+  const uint32_t previous_ramp_steps = ramp_steps_;
+  if (ramp_steps_ >= remaining_steps) {
+    if (ramp_steps_ > 0u) {
+      ramp_steps_--;
+    }
+  } else if (ramp_steps_ + 2u <= remaining_steps &&
+      ramp_steps_ < ramp_limit_steps_) {
+    ramp_steps_++;
+  }
+
+  if (ramp_steps_ != previous_ramp_steps) {
+    step_interval_us_ = rampIntervalUs(ramp_steps_);
+  }
+}
+
+uint32_t StepperController::rampIntervalUs(const uint32_t ramp_steps) const
+    volatile {
+  uint16_t speed_sps = start_speed_sps_;
+  if (move_profile_ == Profile::S_CURVE && ramp_limit_steps_ > 0u) {
+    // Smoothstep 3x^2 - 2x^3 of the fraction x of the ramp completed, all in
+    // Q15 so every intermediate product fits in 32 bits. Its slope is zero at
+    // both ends, so acceleration eases in and out rather than switching on.
+    const uint32_t x = (ramp_steps << 15) / ramp_limit_steps_;
+    const uint32_t x_sq = (x * x) >> 15;
+    const uint32_t smoothstep = (x_sq * (3ul * 32768ul - 2u * x)) >> 15;
+    speed_sps += (static_cast<uint32_t>(cruise_speed_sps_ - start_speed_sps_) *
+        smoothstep) >> 15;
+  } else if (ramp_steps > 0u) {
+    // Planning keeps the speed within the ramp's top, but the acceleration
+    // may have been raised since, so saturate rather than wrap. Only long
+    // ramps, and so low accelerations, need the division.
+    const uint32_t start_sq = static_cast<uint32_t>(start_speed_sps_) *
+        start_speed_sps_;
+    uint32_t speed_sq = 0xFFFFFFFFul;
+    if (ramp_steps <= MAX_UNCHECKED_RAMP_STEPS || acceleration_sps2_ == 0u ||
+        ramp_steps <= (0xFFFFFFFFul - start_sq) / (2u * acceleration_sps2_)) {
+      speed_sq = start_sq + 2u * acceleration_sps2_ * ramp_steps;
+    }
+    speed_sps = isqrt(speed_sq);
+    if (speed_sps > ramp_top_sps_) {
+      speed_sps = ramp_top_sps_;
+    }
+  }
+  return 1000000ul / (speed_sps > 0u ? speed_sps : 1u);
+}
+
+int32_t StepperController::rescaleSteps(const int32_t steps,
+    const int from_steps_per_full_step, const int to_steps_per_full_step) {
+  if (to_steps_per_full_step >= from_steps_per_full_step) {
+    return steps * (to_steps_per_full_step / from_steps_per_full_step);
+  }
+  // Round half up, flooring for negative positions too.
+  const int32_t divisor = from_steps_per_full_step / to_steps_per_full_step;
+  const int32_t shifted = steps + divisor / 2;
+  return shifted >= 0 ? shifted / divisor :
+      -((-shifted + divisor - 1) / divisor);
+}
+
+uint16_t StepperController::isqrt(uint32_t value) {
+  uint32_t root = 0u;
+  uint32_t bit = 1ul << 30;
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit != 0u) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return static_cast<uint16_t>(root);
 }
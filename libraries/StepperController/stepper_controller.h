@@ -9,99 +9,652 @@ class StepperController {
   public:
     // Current motor action.
     enum class Behavior : int {
-      STOPPED = 0,    // Motor is stopped. Default value.
-      FORWARD,        // Motor is moving forward continuously.
-      REVERSE,        // Motor is moving backward continuously.
-      TARGETING,      // Motor is currently approaching its target position.
-      REACHED_TARGET  // Motor has successfully reached its target position.
+      STOPPED = 0,     // Motor is stopped. Default value.
+      FORWARD,         // Motor is moving forward continuously.
+      REVERSE,         // Motor is moving backward continuously.
+      TARGETING,       // Motor is currently approaching its target position.
+      REACHED_TARGET,  // Motor has successfully reached its target position.
+      VELOCITY         // Motor is running at the rate set by setVelocity().
+    };
+
+    // Speed profiles that can be used when approaching a target.
+    enum class Profile : int {
+      CONSTANT = 0,  // Every step is taken at the start speed. Default value.
+      TRAPEZOIDAL,   // Accelerate to cruise speed, then decelerate into target.
+      S_CURVE        // Like TRAPEZOIDAL, but acceleration ramps in and out.
+    };
+
+    // Speed used for every step until motion parameters are configured,
+    // matching the historical fixed step period of 8 ms [steps/s].
+    static const uint16_t DEFAULT_SPEED_SPS = 125u;
+
+    // Angle of one full rotation [cdeg].
+    static const int32_t CENTIDEGREES_PER_ROTATION = 36000;
+
+    // Fastest start or cruise speed: a step every 250 us, which leaves a
+    // 16 MHz ATmega328 time for the main loop between calls to update()
+    // [steps/s].
+    static const uint16_t MAX_SPEED_SPS = 4000u;
+
+    // Greatest acceleration, which reaches MAX_SPEED_SPS in 40 ms
+    // [steps/s^2].
+    static const uint32_t MAX_ACCELERATION_SPS2 = 100000ul;
+
+    // Fixed-point scale of velocity-mode rates: a rate of one step per second
+    // is represented by this value, so rates up to about 2048 steps/s can be
+    // set with a resolution of about one step per 12 days.
+    static const int32_t VELOCITY_SCALE = 1048576L;
+
+    // Number of moves the motion queue can hold. Must be a power of two.
+    static const uint8_t MOTION_QUEUE_LENGTH = 8u;
+
+    // Event flags reported by takeEvents(); several may be combined.
+    static const uint8_t EVENT_MOVE_STARTED = 0x01u;    // Motion began.
+    static const uint8_t EVENT_TARGET_REACHED = 0x02u;  // A target was reached.
+    static const uint8_t EVENT_STOPPED = 0x04u;         // Motion was halted.
+
+    // A coherent copy of the state shared with update().
+    struct Snapshot {
+      int32_t position_steps;  // Position relative to zero [steps].
+      int32_t target_steps;    // Target position relative to zero [steps].
+      int32_t target_cdeg;     // Target angle as requested, or of the
+                               // target steps if queued [cdeg].
+      Behavior behavior;       // Active behavior.
+      uint32_t step_count;     // Steps taken since construction; wraps.
     };
 
     // Constructs a StepperController, delegating a BipolarStepper to manipulate
     // and a number of steps per rotation. The update() function should be
-    // invoked within a timer interrupt at approximately 125 Hz.
+    // invoked within a timer interrupt whose period is reprogrammed to the
+    // value update() returns, so that each invocation lands exactly when a
+    // step is due. The timer may be stopped whenever update() returns zero; the
+    // wake callback announces when it must be restarted.
     //
     // stepper: The BipolarStepper to manipulate.
-    // steps_per_rotation: Number of steps that form one full motor rotation.
+    // steps_per_rotation: Number of full steps that form one full motor
+    //                     rotation. The number of steps used for positions
+    //                     scales with the stepper's step mode.
     StepperController(BipolarStepper* stepper, int16_t steps_per_rotation);
 
-    // Drives the motor forward continuously.
+    // Drives the motor forward continuously at the start speed. Flushes the
+    // motion queue.
     void forward() volatile;
 
-    // Drives the motor backward continuously.
+    // Drives the motor backward continuously at the start speed. Flushes the
+    // motion queue.
     void reverse() volatile;
 
-    // Halts motor motion.
+    // Halts motor motion. Flushes the motion queue.
     void stop() volatile;
 
-    // Rotates the motor to an absolute angle.
+    // Runs the motor continuously at a signed rate, which need not be a whole
+    // number of steps per second. Step times carry their fractional
+    // microseconds forward, so the long-run rate is exact. The rate ramps
+    // from its present value at the configured acceleration. Calling this
+    // again while running changes the rate on the fly; ramping to a rate of
+    // zero stops the motor and posts EVENT_STOPPED. Otherwise flushes the
+    // motion queue.
+    //
+    // steps_per_s_q20: Signed rate, scaled by VELOCITY_SCALE [steps/s].
+    void setVelocity(int32_t steps_per_s_q20) volatile;
+
+    // Retrieves the rate most recently set by setVelocity().
+    //
+    // Returns: Signed rate, scaled by VELOCITY_SCALE [steps/s].
+    int32_t getVelocity() const volatile;
+
+    // Rotates the motor to an absolute angle. The move begins at the start
+    // speed and follows the active speed profile, beginning to decelerate early
+    // enough to arrive at the target at the start speed.
+    //
+    // If the motor is already approaching a target under the same profile, the
+    // new move blends into the present one: a target still ahead of where the
+    // motor could stop is approached without slowing, and any other target is
+    // approached after decelerating to a halt along the present ramp. A move
+    // under another profile, or one begun in velocity mode, likewise first
+    // decelerates to a halt. Moves begun at rest, or while running forward or
+    // in reverse at the start speed, start at once.
+    //
+    // Replaces any queued moves.
     //
-    // target_deg: Absolute angle to rotate the motor to [deg].
-    // Returns: The actual absolute angle rotated to [deg]. May not match the
+    // target_cdeg: Absolute angle to rotate the motor to [cdeg].
+    // Returns: The actual absolute angle rotated to [cdeg]. May not match the
     //          specified angle exactly due to the finite number of steps per
     //          rotation.
-    float rotateTo(float target_deg) volatile;
+    int32_t rotateTo(int32_t target_cdeg) volatile;
 
-    // Rotates the motor by a relative angle.
+    // Rotates the motor to an absolute angle using a specific speed profile for
+    // this move only.
     //
-    // angle_deg: Relative angle to rotate the motor by [deg].
-    // Returns: The actual absolute angle rotated to [deg]. May not match the
+    // target_cdeg: Absolute angle to rotate the motor to [cdeg].
+    // profile: The speed profile to follow during the move.
+    // Returns: The actual absolute angle rotated to [cdeg].
+    int32_t rotateTo(int32_t target_cdeg, Profile profile) volatile;
+
+    // Rotates the motor to an absolute step position, as rotateTo() does, so
+    // that callers with their own angle model avoid a second rounding.
+    //
+    // target_steps: Absolute position to rotate the motor to [steps].
+    // profile: The speed profile to follow during the move.
+    // Returns: The target position [steps].
+    int32_t rotateToSteps(int32_t target_steps, Profile profile) volatile;
+
+    // Rotates the motor by a relative angle from its present position.
+    // Otherwise behaves as rotateTo(), replacing any queued moves and
+    // decelerating first if need be.
+    //
+    // angle_cdeg: Relative angle to rotate the motor by [cdeg].
+    // Returns: The actual absolute angle rotated to [cdeg]. May not match the
     //          specified angle exactly due to the finite number of steps per
     //          rotation.
-    float rotateBy(float angle_deg) volatile;
+    int32_t rotateBy(int32_t angle_cdeg) volatile;
+
+    // Rotates the motor by a relative angle using a specific speed profile for
+    // this move only.
+    //
+    // angle_cdeg: Relative angle to rotate the motor by [cdeg].
+    // profile: The speed profile to follow during the move.
+    // Returns: The actual absolute angle rotated to [cdeg].
+    int32_t rotateBy(int32_t angle_cdeg, Profile profile) volatile;
+
+    // Appends an absolute move to the motion queue. Queued moves are taken one
+    // after another from within update() as soon as the motor is at rest or
+    // has reached its previous target, without waiting on the caller.
+    //
+    // target_cdeg: Absolute angle to rotate the motor to [cdeg].
+    // profile: The speed profile to follow during the move.
+    // dwell_ms: Time to hold at the target before starting the next queued
+    //           move [ms].
+    // Returns: True if the move was queued, or false if the queue is full or
+    //          the motor is running continuously.
+    bool enqueueMove(int32_t target_cdeg, Profile profile, uint16_t dwell_ms)
+        volatile;
+
+    // Appends a move to an absolute step position to the motion queue. See
+    // enqueueMove().
+    //
+    // target_steps: Absolute position to rotate the motor to [steps].
+    // profile: The speed profile to follow during the move.
+    // dwell_ms: Time to hold at the target before starting the next queued
+    //           move [ms].
+    // Returns: True if the move was queued, or false if the queue is full or
+    //          the motor is running continuously.
+    bool enqueueMoveSteps(int32_t target_steps, Profile profile,
+        uint16_t dwell_ms) volatile;
+
+    // Predicts how long a move would take if rotateTo() were called now,
+    // starting from the motor's present speed and direction. A move that
+    // cannot carry on from the present one, such as one that reverses the
+    // direction of travel or changes profile, first decelerates to a halt; a
+    // reversal then also takes up any backlash at the start of its travel.
+    // The prediction treats the S-curve ramp as a constant acceleration of the
+    // same duration, and is meant for comparing candidate moves rather than
+    // for timing them.
+    //
+    // displacement_steps: Signed distance from the present position to the
+    //                     target [steps].
+    // profile: The speed profile the move would follow.
+    // backlash_steps: Lost motion taken up on reversing direction [steps].
+    // Returns: Predicted time until the target is reached [us]; saturates.
+    uint32_t estimateMoveUs(int32_t displacement_steps, Profile profile,
+        uint32_t backlash_steps) const volatile;
+
+    // Predicts how long a move from rest would take, under the same
+    // assumptions as estimateMoveUs().
+    //
+    // distance_steps: Distance to travel, including any backlash [steps].
+    // profile: The speed profile the move would follow.
+    // Returns: Predicted time until the target is reached [us]; saturates.
+    uint32_t estimateRestMoveUs(uint32_t distance_steps, Profile profile) const
+        volatile;
+
+    // Retrieves the number of moves waiting in the motion queue, not counting
+    // the move in progress.
+    //
+    // Returns: Number of queued moves.
+    uint8_t getQueuedMoveCount() const volatile;
+
+    // Discards all queued moves. The move in progress, if any, continues.
+    //
+    // Returns: Number of moves discarded.
+    uint8_t flushQueue() volatile;
+
+    // Captures the motor state shared with update() without tearing. Rather
+    // than disabling interrupts, the read is retried if update() ran while it
+    // was in progress, so the step interrupt is never delayed.
+    //
+    // Returns: The motor state as of a single instant.
+    Snapshot getSnapshot() const volatile;
+
+    // Collects the events that have occurred since the last call. Targets
+    // reached and queued moves started within update() are recorded there, so
+    // none are missed however briefly the motor stays in a given behavior.
+    //
+    // Returns: A combination of EVENT_* flags, or zero if nothing happened.
+    uint8_t takeEvents() volatile;
 
     // Retrieves the current absolute position of the motor.
     //
-    // Returns: The current absolute position of the motor [deg].
-    float getPositionDeg() const volatile;
+    // Returns: The current absolute position of the motor [cdeg].
+    int32_t getPositionCdeg() const volatile;
 
     // Retrieves the current target position of the motor.
     //
-    // Returns: The current target position of the motor [deg].
-    float getTarget() const volatile;
+    // Returns: The current target position of the motor [cdeg].
+    int32_t getTargetCdeg() const volatile;
 
     // Establishes the current motor position to be an absolute angle of zero.
+    // The motor should be stopped first.
     void setZero() volatile;
 
-    // Offsets the existing zero reference by an angle.
+    // Offsets the existing zero reference by an angle. The motor should be
+    // stopped first.
+    //
+    // relative_angle_cdeg: The angle to offset the zero reference by [cdeg].
+    void offsetZero(int32_t relative_angle_cdeg) volatile;
+
+    // Offsets the existing zero reference by a number of steps. The motor
+    // should be stopped first.
+    //
+    // relative_steps: The distance to offset the zero reference by [steps].
+    void offsetZeroSteps(int32_t relative_steps) volatile;
+
+    // Retrieves how far the zero reference has been moved in total by
+    // setZero() and the offsetZero() functions since construction. A position
+    // plus this offset is the same physical position whatever zero is in use.
+    //
+    // Returns: Total offset of the zero reference in the active step mode
+    //          [steps].
+    int32_t getZeroOffsetSteps() const volatile;
+
+    // Sets the speed at which moves begin and end, and at which continuous
+    // forward() and reverse() motion runs. This should be slow enough that the
+    // motor can start from rest without stalling. Takes effect on the next
+    // move.
+    //
+    // steps_per_s: Start speed [steps/s]. Clamped to the range [1, 65535].
+    void setStartSpeed(uint32_t steps_per_s) volatile;
+
+    // Sets the speed the motor accelerates to during ramped moves. Takes effect
+    // on the next move.
+    //
+    // steps_per_s: Cruise speed [steps/s]. Values below the start speed
+    //              disable ramping. Clamped to a maximum of 65535.
+    void setCruiseSpeed(uint32_t steps_per_s) volatile;
+
+    // Sets the rate at which the motor speeds up and slows down during ramped
+    // moves. Takes effect on the next move.
+    //
+    // steps_per_s2: Acceleration [steps/s^2]. Zero disables ramping.
+    void setAcceleration(uint32_t steps_per_s2) volatile;
+
+    // Selects the speed profile used by subsequent calls to rotateTo() and
+    // rotateBy() that don't specify one.
     //
-    // relative_angle_deg: The angle to offset the zero reference by [deg].
-    void offsetZero(float relative_angle_deg) volatile;
+    // profile: The speed profile to use.
+    void setProfile(Profile profile) volatile;
 
-    // Updates the state of the motor. For best results, this should be called
-    // within a timer interrupt triggering at approximately 125 Hz.
-    void update() volatile;
+    // Retrieves the current start speed.
+    //
+    // Returns: The start speed [steps/s].
+    uint16_t getStartSpeed() const volatile;
+
+    // Retrieves the current cruise speed.
+    //
+    // Returns: The cruise speed [steps/s].
+    uint16_t getCruiseSpeed() const volatile;
+
+    // Retrieves the current acceleration.
+    //
+    // Returns: The acceleration [steps/s^2].
+    uint32_t getAcceleration() const volatile;
+
+    // Retrieves the speed profile used for targeted moves.
+    //
+    // Returns: The active speed profile.
+    Profile getProfile() const volatile;
+
+    // Selects how finely the stepper divides each full step. Halts motion as
+    // stop() does, then rescales the position, target and motion parameters
+    // so that they describe the same angles and angular speeds in the new
+    // step units.
+    //
+    // step_mode: The step mode to use from now on.
+    void setStepMode(BipolarStepper::StepMode step_mode) volatile;
+
+    // Retrieves the stepper's active step mode.
+    //
+    // Returns: The active step mode.
+    BipolarStepper::StepMode getStepMode() const volatile;
+
+    // Retrieves the number of steps in one full motor rotation in the active
+    // step mode.
+    //
+    // Returns: Steps per rotation.
+    int16_t getStepsPerRotation() const volatile;
+
+    // Establishes a function to call when motion is requested while the step
+    // timer is idle. The function should restart the timer so that update()
+    // is next invoked after the given period.
+    //
+    // cb: The function to invoke when the step timer must be restarted. Set to
+    //     nullptr to remove the callback.
+    //  -> period_us: Time until update() should next be invoked [us].
+    void setWakeCallback(void (*cb)(uint32_t period_us)) volatile;
+
+    // Establishes a function to call from update() once a target has been
+    // reached, for work that must be timed precisely after arrival, such as
+    // triggering a camera. The function is called on arrival and then again
+    // whenever the delay it returned has passed. The next queued move waits
+    // for both the move's dwell and the function to finish.
+    //
+    // cb: The function to invoke after arrival. Set to nullptr to remove the
+    //     callback.
+    //  -> since_arrival_us: Time since the target was reached [us]; zero on
+    //                       arrival.
+    //  -> returns: Time until the function should next be called [us], or
+    //              zero once it is finished.
+    void setSettleCallback(uint32_t (*cb)(uint32_t since_arrival_us))
+        volatile;
+
+    // Establishes a function to call from update() before a queued move
+    // starts. If it declines, it is asked again every GATE_POLL_PERIOD_US.
+    //
+    // cb: The function to invoke before a queued move starts. Set to nullptr
+    //     to remove the callback.
+    //  -> returns: True if the move may start.
+    void setDepartureCallback(bool (*cb)()) volatile;
+
+    // Establishes a function to call whenever motion is commanded directly
+    // rather than taken from the queue, so that whatever the settle callback
+    // began can be ended; the settle callback isn't called again for an
+    // arrival once the motor has left it.
+    //
+    // cb: The function to invoke before commanded motion starts. Set to
+    //     nullptr to remove the callback.
+    void setReleaseCallback(void (*cb)()) volatile;
+
+    // Checks whether the step timer is idle, i.e. update() last returned zero
+    // and no motion has been requested since.
+    //
+    // Returns: True if the step timer may be stopped.
+    bool isIdle() const volatile;
+
+    // Takes a step if one is due and updates the state of the motor. This
+    // should be called within a timer interrupt.
+    //
+    // Returns: Time until update() should next be invoked [us], or zero if no
+    //          motion is pending and the timer may be stopped until the wake
+    //          callback fires.
+    uint32_t update() volatile;
 
     // Converts an absolute motor position to an absolute number of motor steps.
     //
-    // degrees: The absolute angle to convert [deg].
+    // centidegrees: The absolute angle to convert [cdeg].
     // Returns: The integral number of steps forming an angle closest to the
     //          given angle.
-    int32_t degreesToSteps(float degrees) const volatile;
+    int32_t centidegreesToSteps(int32_t centidegrees) const volatile;
 
     // Converts a number of motor steps to an absolute angular position.
     //
     // steps: The number of steps.
-    // Returns: The angle formed by traveling the given number of steps [deg].
-    float stepsToDegrees(int32_t steps) const volatile;
+    // Returns: The angle formed by traveling the given number of steps, rounded
+    //          to the nearest centidegree [cdeg].
+    int32_t stepsToCentidegrees(int32_t steps) const volatile;
 
   private:
+    // Longest S-curve ramp whose progress can be computed in Q15 without
+    // overflowing 32-bit arithmetic [steps].
+    static const uint32_t MAX_S_CURVE_RAMP_STEPS = 0xFFFFu;
+
+    // Longest ramp over which v0^2 + 2 * a * n fits in 32 bits at any start
+    // speed and acceleration [steps].
+    static const uint32_t MAX_UNCHECKED_RAMP_STEPS = (0xFFFFFFFFul -
+        static_cast<uint32_t>(MAX_SPEED_SPS) * MAX_SPEED_SPS) /
+        (2u * MAX_ACCELERATION_SPS2);
+
+    // Longest timer period used while dwelling; longer dwells are split into
+    // several periods [us].
+    static const uint32_t MAX_DWELL_PERIOD_US = 1000000ul;
+
+    // Longest timer period used in velocity mode [us]. Keeps rate changes
+    // prompt at slow rates, and is within the range TimerOne can realize to
+    // the microsecond at 16 MHz.
+    static const uint32_t MAX_VELOCITY_PERIOD_US = 50000ul;
+
+    // Time between asking the departure callback whether a queued move may
+    // start [us].
+    static const uint32_t GATE_POLL_PERIOD_US = 1000ul;
+
+    // A move waiting in the motion queue.
+    struct QueuedMove {
+      int32_t target_steps;
+      uint16_t dwell_ms;
+      Profile profile;
+    };
+
+    // Pops the next move from the motion queue and begins it. Called only
+    // from update().
+    //
+    // Returns: True if a move was started, or false if the queue was empty.
+    bool startQueuedMove() volatile;
+
+    // Starts or blends into a targeted move. See rotateTo().
+    //
+    // target_steps: Absolute position to rotate the motor to [steps].
+    // target_cdeg: The angle to report as the target [cdeg].
+    // profile: The speed profile to follow during the move.
+    void beginMove(int32_t target_steps, int32_t target_cdeg, Profile profile)
+        volatile;
+
+    // Resets the speed ramp so that the next move starts at the start speed,
+    // and determines how far the ramp may climb under the given profile.
+    //
+    // profile: The speed profile to follow during the move.
+    void planMove(Profile profile) volatile;
+
+    // Turns velocity-mode motion into the end of a trapezoidal move, which
+    // halts at the start speed as soon as it can. Interrupts must be held
+    // off.
+    void leaveVelocity() volatile;
+
+    // Abandons what follows the last arrival, ahead of motion commanded
+    // directly: stops calling the settle callback and invokes the release
+    // callback.
+    void leaveArrival() volatile;
+
+    // Records events from outside update(), which also records events.
+    //
+    // events: A combination of EVENT_* flags.
+    void postEvents(uint8_t events) volatile;
+
+    // Restarts the step timer via the wake callback if it has gone idle. Must
+    // be called after behavior_ is set to a moving behavior so that an update()
+    // racing with this function either sees the motion or leaves idle_ set.
+    void wake() volatile;
+
+    // Advances or retreats along the speed ramp after a targeted step so that
+    // the motor can always decelerate to the start speed by the target.
+    //
+    // remaining_steps: Number of steps still to be taken to reach the target.
+    void advanceRamp(uint32_t remaining_steps) volatile;
+
+    // Computes the constant acceleration a speed profile is predicted as.
+    //
+    // profile: The speed profile.
+    // Returns: Acceleration [steps/s^2], or zero if every step of the profile
+    //          is taken at the start speed.
+    uint32_t profileAccelerationSps2(Profile profile) const volatile;
+
+    // Predicts the time to travel a distance from a given speed, accelerating
+    // toward the cruise speed and arriving at the start speed.
+    //
+    // distance_steps: Distance to travel [steps].
+    // entry_sps: Speed at the outset [steps/s].
+    // acceleration_sps2: Acceleration to assume [steps/s^2]. Zero means every
+    //                    step is taken at the start speed.
+    // Returns: Time to arrival [us]; saturates.
+    uint32_t estimateTravelUs(uint32_t distance_steps, uint32_t entry_sps,
+        uint32_t acceleration_sps2) const volatile;
+
+    // Computes the time between steps at a given point along the speed ramp.
+    //
+    // ramp_steps: Number of steps of acceleration taken so far.
+    // Returns: The step interval [us].
+    uint32_t rampIntervalUs(uint32_t ramp_steps) const volatile;
+
+    // Takes a velocity-mode step if one is due and ramps the rate. Called
+    // only from update().
+    //
+    // Returns: Time until update() should next be invoked [us], or zero if
+    //          the rate has ramped to zero and the motor has stopped.
+    uint32_t updateVelocity() volatile;
+
+    // Moves the velocity-mode rate toward the requested rate.
+    //
+    // elapsed_us: Time over which to accelerate [us].
+    void rampVelocity(uint32_t elapsed_us) volatile;
+
+    // Computes the time until the next velocity-mode step at the present
+    // rate, carrying the fractional microsecond forward.
+    //
+    // Returns: The step interval [us], or 0xFFFFFFFF if the rate is too slow
+    //          to express.
+    uint32_t velocityIntervalUs() volatile;
+
+    // Divides two integers, rounding the quotient to the nearest integer.
+    //
+    // numerator: The dividend.
+    // denominator: The divisor. Must be positive.
+    // Returns: The quotient, with halves rounded away from zero.
+    static int32_t roundedDivide(int32_t numerator, int32_t denominator);
+
+    // Converts a step count between two step modes, rounding to the nearest
+    // step of the new mode the same way BipolarStepper rounds its phase.
+    //
+    // steps: The step count in the old step mode.
+    // from_steps_per_full_step: Steps per full step in the old step mode.
+    // to_steps_per_full_step: Steps per full step in the new step mode.
+    // Returns: The equivalent step count in the new step mode.
+    static int32_t rescaleSteps(int32_t steps, int from_steps_per_full_step,
+        int to_steps_per_full_step);
+
+    // Computes the integer square root of a value.
+    //
+    // value: The value whose square root to take.
+    // Returns: The largest integer whose square does not exceed the value.
+    static uint16_t isqrt(uint32_t value);
+
     // The BipolarStepper driver this StepperController manipulates.
     BipolarStepper* const stepper_;
 
-    // The number of steps of the motor constituting one full revolution.
-    const int16_t steps_per_rotation_;
+    // The number of full steps of the motor constituting one full revolution.
+    const int16_t full_steps_per_rotation_;
+
+    // The number of steps in the active step mode constituting one full
+    // revolution.
+    int16_t steps_per_rotation_;
 
     // Current position of the motor in steps relative to zero.
     volatile int32_t position_steps_;
 
-    // Current target absolute angle of the motor [deg].
-    float target_deg_;
+    // Total distance the zero reference has been moved since construction
+    // [steps].
+    int32_t zero_offset_steps_;
+
+    // Current target absolute angle of the motor [cdeg].
+    volatile int32_t target_cdeg_;
 
     // Current target absolute position of the motor in steps.
-    int32_t target_steps_;
+    volatile int32_t target_steps_;
 
     // Currently active behavior.
     volatile Behavior behavior_;
+
+    // Number of steps taken since construction.
+    volatile uint32_t step_count_;
+
+    // Events not yet collected by takeEvents().
+    volatile uint8_t pending_events_;
+
+    // Incremented by every call to update() so that getSnapshot() can detect
+    // that its read was interrupted.
+    volatile uint8_t update_sequence_;
+
+    // Motion parameters. See the corresponding setters.
+    uint16_t start_speed_sps_;
+    uint16_t cruise_speed_sps_;
+    uint32_t acceleration_sps2_;
+    Profile profile_;
+
+    // Speed profile of the move currently in progress.
+    Profile move_profile_;
+
+    // Where to head once the motor has halted, when a move has reversed the
+    // direction of travel, and the profile to head there with [steps].
+    bool has_pending_target_;
+    int32_t pending_target_steps_;
+    Profile pending_profile_;
+
+    // Direction of the most recent step: 1 forward, -1 backward, or 0 if no
+    // step has been taken.
+    volatile int8_t last_direction_;
+
+    // Number of steps of acceleration the current move has taken, and the
+    // number after which the motor reaches cruise speed.
+    uint32_t ramp_steps_;
+    uint32_t ramp_limit_steps_;
+
+    // Fastest speed the current ramp may reach: the cruise speed, or the rate
+    // velocity mode was left at [steps/s].
+    uint16_t ramp_top_sps_;
+
+    // Time between steps at the current point of the ramp [us].
+    uint32_t step_interval_us_;
+
+    // Time to hold at the target of the current move, and time left to hold
+    // now that it has been reached [us].
+    uint32_t move_dwell_us_;
+    uint32_t dwell_remaining_us_;
+
+    // Whether the settle callback has yet to finish since the last arrival,
+    // time until it is next due, and time since arrival [us].
+    bool settling_;
+    uint32_t settle_remaining_us_;
+    uint32_t since_arrival_us_;
+
+    // Requested and present rates in velocity mode, scaled by VELOCITY_SCALE
+    // [steps/s].
+    int32_t velocity_target_q20_;
+    int32_t velocity_q20_;
+
+    // Time left until the next velocity-mode step, and the length of the
+    // period update() last returned in velocity mode [us].
+    uint32_t velocity_wait_us_;
+    uint32_t velocity_period_us_;
+
+    // Fraction of a microsecond owed to the next step interval, in units of
+    // 1/velocity_q20_ us.
+    uint32_t velocity_carry_;
+
+    // Ring buffer of queued moves. The free-running tail is advanced only by
+    // enqueueMove(). The head is advanced by update(), except that
+    // flushQueue() moves it from the main loop with interrupts held off.
+    QueuedMove queue_[MOTION_QUEUE_LENGTH];
+    volatile uint8_t queue_head_;
+    volatile uint8_t queue_tail_;
+
+    // Whether update() has reported that the step timer may be stopped.
+    volatile bool idle_;
+
+    // Callback to invoke when motion is requested while idle.
+    void (*wake_callback_)(uint32_t period_us);
+
+    // Callbacks to invoke after arrival, before a queued move starts and
+    // before commanded motion starts.
+    uint32_t (*settle_callback_)(uint32_t since_arrival_us);
+    bool (*departure_callback_)();
+    void (*release_callback_)();
 };
 
 #endif
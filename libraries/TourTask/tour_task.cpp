@@ -0,0 +1,248 @@
+#include "tour_task.h"
+#include "mask_controller.h"
+#include "stepper_controller.h"
+#include <Arduino.h>
+
+TourTask::TourTask(MaskController* const mask_controller)
+    : mask_controller_(mask_controller), stops_cdeg_(), num_stops_(0u),
+    from_cdeg_(0), first_forward_index_(0u),
+    first_direction_(MaskController::Direction::FORWARD), turn_count_(0u),
+    planned_ms_(0u), profile_(StepperController::Profile::CONSTANT),
+    dwell_ms_(0u), state_(State::IDLE), stops_queued_(0u), stops_reached_(0u),
+    tour_event_callback_(nullptr) {}
+
+bool TourTask::addStop(const int32_t angle_cdeg) {
+  if (isActive() || num_stops_ >= MAX_STOPS) {
+    return false;
+  }
+  const int32_t wrapped_cdeg =
+      angle_cdeg % MaskController::CENTIDEGREES_PER_ROTATION;
+  stops_cdeg_[num_stops_] = wrapped_cdeg >= 0 ? wrapped_cdeg :
+      wrapped_cdeg + MaskController::CENTIDEGREES_PER_ROTATION;
+  num_stops_++;
+  return true;
+}
+
+uint8_t TourTask::getStopCount() const {
+  return num_stops_;
+}
+
+void TourTask::clear() {
+  abort();
+  num_stops_ = 0u;
+}
+
+bool TourTask::start(const StepperController::Profile profile,
+    const uint16_t dwell_ms) {
+  if (isActive() || num_stops_ == 0u) {
+    return false;
+  }
+  // Plan from where the mask will come to rest. Anything but a targeted move
+  // is halted, which also brings the end of the queue up to date.
+  const StepperController::Behavior behavior =
+      mask_controller_->getSnapshot(false).behavior;
+  int32_t from_cdeg = 0;
+  if (behavior == StepperController::Behavior::TARGETING ||
+      behavior == StepperController::Behavior::REACHED_TARGET) {
+    mask_controller_->flushQueue();
+    from_cdeg = mask_controller_->getTargetCdeg(false);
+  } else {
+    mask_controller_->stop();
+    from_cdeg = mask_controller_->getPositionCdeg(false);
+  }
+
+  profile_ = profile;
+  dwell_ms_ = dwell_ms;
+  plan(from_cdeg);
+  stops_queued_ = 0u;
+  stops_reached_ = 0u;
+  state_ = State::RUNNING;
+  step();
+  return true;
+}
+
+void TourTask::abort() {
+  if (!isActive()) {
+    return;
+  }
+  mask_controller_->stop();
+  state_ = State::ABORTED;
+  announce(TourEvent::ABORTED, stops_reached_);
+}
+
+void TourTask::step() {
+  if (!isActive()) {
+    return;
+  }
+
+  // Read the queue before the behavior: if a move starts in between, we
+  // undercount for now rather than overcount.
+  const uint8_t waiting = mask_controller_->getQueuedMoveCount();
+  const StepperController::Behavior behavior =
+      mask_controller_->getSnapshot(false).behavior;
+  const bool moving = behavior == StepperController::Behavior::TARGETING;
+
+  // As for ScanTask, anything but targeting or holding at targets while our
+  // stops are under way means the mask was commandeered.
+  if (stops_queued_ > 0u && waiting == 0u && !moving &&
+      behavior != StepperController::Behavior::REACHED_TARGET) {
+    state_ = State::ABORTED;
+    announce(TourEvent::ABORTED, stops_reached_);
+    return;
+  }
+
+  const uint8_t stops_reached = stops_queued_ - waiting - (moving ? 1u : 0u);
+  while (stops_reached_ < stops_reached) {
+    announce(TourEvent::STOP_REACHED, stops_reached_);
+    stops_reached_++;
+  }
+
+  while (stops_queued_ < num_stops_) {
+    if (mask_controller_->enqueueMoveTo(
+        stops_cdeg_[plannedIndex(stops_queued_)],
+        plannedDirection(stops_queued_), profile_, dwell_ms_, false) ==
+        MaskController::INVALID_CDEG) {
+      // Queue is full; we'll top it up next time.
+      break;
+    }
+    stops_queued_++;
+  }
+
+  // The mask only goes idle once the final dwell has elapsed.
+  if (stops_queued_ == num_stops_ && stops_reached_ == num_stops_ &&
+      mask_controller_->isIdle()) {
+    state_ = State::FINISHED;
+    announce(TourEvent::FINISHED, num_stops_ - 1u);
+  }
+}
+
+TourTask::State TourTask::getState() const {
+  return state_;
+}
+
+uint32_t TourTask::getPlannedMs() const {
+  return planned_ms_;
+}
+
+void TourTask::setTourEventCallback(
+    void (*const cb)(TourEvent event, uint8_t stop, int32_t angle_cdeg)) {
+  tour_event_callback_ = cb;
+}
+
+// A tour that turns back after some stops takes the first moves of one sweep,
+// a move back past the start to the first stop of the opposite sweep, and the
+// remaining moves of that sweep. Every candidate is built from running sums of
+// the two sweeps, so the whole plan takes a number of predictions linear in
+// the number of stops.
+void TourTask::plan(const int32_t from_cdeg) {
+  // Insertion sort; the set is small.
+  for (uint8_t i = 1u; i < num_stops_; ++i) {
+    const uint16_t stop_cdeg = stops_cdeg_[i];
+    uint8_t j = i;
+    while (j > 0u && stops_cdeg_[j - 1u] > stop_cdeg) {
+      stops_cdeg_[j] = stops_cdeg_[j - 1u];
+      j--;
+    }
+    stops_cdeg_[j] = stop_cdeg;
+  }
+
+  from_cdeg_ = from_cdeg;
+  const int32_t wrapped_cdeg =
+      from_cdeg % MaskController::CENTIDEGREES_PER_ROTATION;
+  const int32_t start_cdeg = wrapped_cdeg >= 0 ? wrapped_cdeg :
+      wrapped_cdeg + MaskController::CENTIDEGREES_PER_ROTATION;
+  uint8_t first_forward_index = 0u;
+  while (first_forward_index < num_stops_ &&
+      stops_cdeg_[first_forward_index] < start_cdeg) {
+    first_forward_index++;
+  }
+  first_forward_index_ = first_forward_index % num_stops_;
+
+  // The two sweeps all the way round.
+  uint32_t forward_us = 0u;
+  uint32_t reverse_us = 0u;
+  for (uint8_t count = 0u; count < num_stops_; ++count) {
+    forward_us += sweepMoveUs(MaskController::Direction::FORWARD, count);
+    reverse_us += sweepMoveUs(MaskController::Direction::REVERSE, count);
+  }
+  uint32_t best_us = forward_us;
+  first_direction_ = MaskController::Direction::FORWARD;
+  turn_count_ = num_stops_;
+  if (reverse_us < best_us) {
+    best_us = reverse_us;
+    first_direction_ = MaskController::Direction::REVERSE;
+  }
+
+  // Each way of turning back partway.
+  for (uint8_t first = 0u; first < 2u; ++first) {
+    const MaskController::Direction direction = first == 0u ?
+        MaskController::Direction::FORWARD :
+        MaskController::Direction::REVERSE;
+    const MaskController::Direction other = first == 0u ?
+        MaskController::Direction::REVERSE :
+        MaskController::Direction::FORWARD;
+    const uint32_t other_first_us = sweepMoveUs(other, 0u);
+    uint32_t outbound_us = 0u;
+    uint32_t other_rest_us = first == 0u ? reverse_us : forward_us;
+    for (uint8_t turn = 1u; turn < num_stops_; ++turn) {
+      outbound_us += sweepMoveUs(direction, turn - 1u);
+      // Now the time for the first (num_stops_ - turn) moves of the other
+      // sweep.
+      other_rest_us -= sweepMoveUs(other, num_stops_ - turn);
+      const uint32_t return_us = mask_controller_->estimateMoveUs(
+          stops_cdeg_[sweepIndex(direction, turn - 1u)],
+          stops_cdeg_[sweepIndex(other, 0u)], other, profile_, true);
+      const uint32_t total_us =
+          outbound_us + return_us + other_rest_us - other_first_us;
+      if (total_us < best_us) {
+        best_us = total_us;
+        first_direction_ = direction;
+        turn_count_ = turn;
+      }
+    }
+  }
+  planned_ms_ = (best_us + 500u) / 1000u;
+}
+
+uint8_t TourTask::sweepIndex(const MaskController::Direction direction,
+    const uint8_t count) const {
+  if (direction == MaskController::Direction::FORWARD) {
+    return (first_forward_index_ + count) % num_stops_;
+  }
+  return (first_forward_index_ + num_stops_ - 1u - count) % num_stops_;
+}
+
+uint32_t TourTask::sweepMoveUs(const MaskController::Direction direction,
+    const uint8_t count) const {
+  const int32_t from_cdeg = count == 0u ? from_cdeg_ :
+      stops_cdeg_[sweepIndex(direction, count - 1u)];
+  return mask_controller_->estimateMoveUs(from_cdeg,
+      stops_cdeg_[sweepIndex(direction, count)], direction, profile_, false);
+}
+
+uint8_t TourTask::plannedIndex(const uint8_t visited) const {
+  if (visited < turn_count_) {
+    return sweepIndex(first_direction_, visited);
+  }
+  return sweepIndex(plannedDirection(visited), visited - turn_count_);
+}
+
+MaskController::Direction TourTask::plannedDirection(const uint8_t visited)
+    const {
+  if (visited < turn_count_) {
+    return first_direction_;
+  }
+  return first_direction_ == MaskController::Direction::FORWARD ?
+      MaskController::Direction::REVERSE : MaskController::Direction::FORWARD;
+}
+
+void TourTask::announce(const TourEvent event, const uint8_t visited) const {
+  if (tour_event_callback_ != nullptr) {
+    tour_event_callback_(event, visited,
+        visited < num_stops_ ? stops_cdeg_[plannedIndex(visited)] : 0);
+  }
+}
+
+bool TourTask::isActive() const {
+  return state_ == State::RUNNING;
+}
@@ -0,0 +1,176 @@
+#ifndef TOUR_TASK_H_
+#define TOUR_TASK_H_
+
+#include "mask_controller.h"
+#include "stepper_controller.h"
+#include <Arduino.h>  // For int32_t, uint8_t, uint16_t, uint32_t
+
+// Operates a cooperative task that visits a set of mask angles in whichever
+// order is predicted to take the least motion time, holding at each for a
+// fixed dwell time. As with ScanTask, the motion queue is kept topped up so
+// that the moves are timed by the step interrupt. No other functions should
+// attempt to manipulate the MaskController or its dependencies while a tour
+// is running; call abort() first.
+//
+// Every stop is a move from rest to rest, so the fastest way round is to sweep
+// through the angles in order around the circle, turning back at most once.
+// The plan compares the two full sweeps with every sweep that turns back
+// partway, timing each move with MaskController::estimateMoveUs() so that
+// gear quantization, the speed profile and backlash are all accounted for.
+class TourTask {
+ public:
+  // List of possible states the TourTask can be in.
+  enum class State : int {
+    IDLE = 0,  // No tour has been started. Default value.
+    RUNNING,   // Moving through the tour.
+    FINISHED,  // Every stop has been visited.
+    ABORTED    // The tour was abandoned before finishing.
+  };
+
+  // Progress notifications.
+  enum class TourEvent : int {
+    NONE = 0,      // Default value.
+    STOP_REACHED,  // The mask arrived at a stop and has begun its dwell.
+    FINISHED,      // The final dwell has elapsed.
+    ABORTED        // The tour was abandoned.
+  };
+
+  // Largest number of stops in a tour.
+  static const uint8_t MAX_STOPS = 32u;
+
+  // Constructs a new TourTask, designating the MaskController it will operate.
+  //
+  // mask_controller: The MaskController to operate.
+  explicit TourTask(MaskController* mask_controller);
+
+  // Adds an angle to the set to visit.
+  //
+  // angle_cdeg: Absolute mask angle [cdeg]. Wrapped to [0, 360) degrees.
+  // Returns: True if the stop was added, or false if the set is full or a
+  //          tour is running.
+  bool addStop(int32_t angle_cdeg);
+
+  // Retrieves the number of stops in the set.
+  //
+  // Returns: Number of stops.
+  uint8_t getStopCount() const;
+
+  // Discards all stops, abandoning any tour in progress.
+  void clear();
+
+  // Plans the order of the stops from where the mask is headed, then starts
+  // visiting them. Continuous motion is halted and queued moves are replaced.
+  //
+  // profile: The speed profile to follow between stops.
+  // dwell_ms: Time to hold at each stop [ms].
+  // Returns: True if the tour was started, or false if there are no stops or
+  //          a tour is already running.
+  bool start(StepperController::Profile profile, uint16_t dwell_ms);
+
+  // Abandons a running tour, halting the mask immediately.
+  void abort();
+
+  // Keeps the motion queue supplied and reports progress. Call this as
+  // frequently as possible.
+  void step();
+
+  // Retrieves the current state of the TourTask. See the State enumeration.
+  //
+  // Returns: The current State enumerator describing the state of the task.
+  State getState() const;
+
+  // Retrieves the motion time predicted for the planned order, excluding
+  // dwells.
+  //
+  // Returns: Predicted time to visit every stop [ms].
+  uint32_t getPlannedMs() const;
+
+  // Establishes a function to call to report the progress of a tour.
+  //
+  // cb: The function to invoke with progress. Set to nullptr to remove the
+  //     callback.
+  //  -> event: What happened.
+  //  -> stop: How many stops were visited before the one concerned.
+  //  -> angle_cdeg: Angle of the stop concerned [cdeg].
+  void setTourEventCallback(void (*cb)(TourEvent event, uint8_t stop,
+      int32_t angle_cdeg));
+
+ private:
+  // Sorts the stops by angle and chooses the fastest order to visit them.
+  //
+  // from_cdeg: The unwrapped angle the tour starts from [cdeg].
+  void plan(int32_t from_cdeg);
+
+  // Finds the stop reached after a number of stops along a sweep from the
+  // start of the tour.
+  //
+  // direction: FORWARD or REVERSE.
+  // count: Number of stops passed before it on the sweep.
+  // Returns: Index of the stop in stops_cdeg_.
+  uint8_t sweepIndex(MaskController::Direction direction, uint8_t count)
+      const;
+
+  // Predicts the time taken by a move of a sweep.
+  //
+  // direction: FORWARD or REVERSE.
+  // count: Number of stops passed on the sweep before the move's target.
+  // Returns: Predicted duration of the move [us].
+  uint32_t sweepMoveUs(MaskController::Direction direction, uint8_t count)
+      const;
+
+  // Finds the stop visited after a number of others in the planned order.
+  //
+  // visited: Number of stops visited before it.
+  // Returns: Index of the stop in stops_cdeg_.
+  uint8_t plannedIndex(uint8_t visited) const;
+
+  // Finds the direction of the move to a stop in the planned order.
+  //
+  // visited: Number of stops visited before it.
+  // Returns: FORWARD or REVERSE.
+  MaskController::Direction plannedDirection(uint8_t visited) const;
+
+  // Reports progress via callback.
+  //
+  // event: What happened.
+  // visited: Number of stops visited before the one concerned.
+  void announce(TourEvent event, uint8_t visited) const;
+
+  // Checks whether a tour is running.
+  //
+  // Returns: True if the task is running.
+  bool isActive() const;
+
+  // The MaskController to manipulate.
+  MaskController* const mask_controller_;
+
+  // The stops, sorted by angle once planned [cdeg].
+  uint16_t stops_cdeg_[MAX_STOPS];
+  uint8_t num_stops_;
+
+  // The plan: the angle it starts from [cdeg], the index of the first stop at
+  // or after it, the direction of the first sweep, the number of stops
+  // visited before turning back, and its predicted motion time [ms].
+  int32_t from_cdeg_;
+  uint8_t first_forward_index_;
+  MaskController::Direction first_direction_;
+  uint8_t turn_count_;
+  uint32_t planned_ms_;
+
+  // Motion settings for the tour.
+  StepperController::Profile profile_;
+  uint16_t dwell_ms_;
+
+  // Current state of the TourTask.
+  State state_;
+
+  // Number of stops sent to the motion queue and number reached so far.
+  uint8_t stops_queued_;
+  uint8_t stops_reached_;
+
+  // Callback to invoke with progress.
+  void (*tour_event_callback_)(TourEvent event, uint8_t stop,
+      int32_t angle_cdeg);
+};
+
+#endif
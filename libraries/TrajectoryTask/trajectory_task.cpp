@@ -0,0 +1,200 @@
+#include "trajectory_task.h"
+#include "mask_controller.h"
+#include "stepper_controller.h"
+#include <Arduino.h>
+
+TrajectoryTask::TrajectoryTask(MaskController* const mask_controller) :
+    mask_controller_(mask_controller), waypoints_(), num_waypoints_(0u),
+    offset_cdeg_(0), state_(State::IDLE), armed_(false), start_ms_(0u),
+    last_update_ms_(0u), velocity_udeg_per_s_(0), velocity_commanded_(false),
+    trigger_callback_(nullptr), state_change_callback_(nullptr) {}
+
+bool TrajectoryTask::addWaypoint(const uint32_t time_ms,
+    const int32_t angle_cdeg) {
+  if (isActive() || num_waypoints_ >= MAX_WAYPOINTS) {
+    return false;
+  }
+  if (num_waypoints_ > 0u &&
+      time_ms < waypoints_[num_waypoints_ - 1u].time_ms) {
+    return false;
+  }
+  waypoints_[num_waypoints_].time_ms = time_ms;
+  waypoints_[num_waypoints_].angle_cdeg = angle_cdeg;
+  num_waypoints_++;
+  return true;
+}
+
+uint8_t TrajectoryTask::getWaypointCount() const {
+  return num_waypoints_;
+}
+
+void TrajectoryTask::clear() {
+  abort();
+  num_waypoints_ = 0u;
+}
+
+bool TrajectoryTask::startAt(const unsigned long start_ms) {
+  start_ms_ = start_ms;
+  return begin(false);
+}
+
+bool TrajectoryTask::arm() {
+  return begin(true);
+}
+
+void TrajectoryTask::abort() {
+  if (!isActive()) {
+    return;
+  }
+  mask_controller_->stop();
+  setState(State::ABORTED);
+}
+
+void TrajectoryTask::step(const unsigned long now_ms) {
+  if (state_ == State::WAITING) {
+    if (armed_) {
+      if (trigger_callback_ == nullptr || !trigger_callback_()) {
+        return;
+      }
+      start_ms_ = now_ms;
+    } else if (static_cast<long>(now_ms - start_ms_) < 0) {
+      return;
+    }
+    last_update_ms_ = now_ms - UPDATE_PERIOD_MS;
+    setState(State::RUNNING);
+  }
+  if (state_ != State::RUNNING ||
+      now_ms - last_update_ms_ < UPDATE_PERIOD_MS) {
+    return;
+  }
+  last_update_ms_ = now_ms;
+
+  const MaskController::Snapshot snapshot =
+      mask_controller_->getSnapshot(false);
+  if (velocity_commanded_) {
+    // Once we've commanded a rate, the mask only runs at it, or rests once
+    // we've ramped it down to zero. Anything else means something else has
+    // taken over the mask.
+    if (snapshot.behavior != StepperController::Behavior::VELOCITY &&
+        (snapshot.behavior != StepperController::Behavior::STOPPED ||
+            velocity_udeg_per_s_ != 0)) {
+      setState(State::ABORTED);
+      return;
+    }
+  } else if (snapshot.behavior == StepperController::Behavior::TARGETING) {
+    // Still on the way to the first waypoint; we'll catch up from there.
+    return;
+  } else if (snapshot.behavior == StepperController::Behavior::FORWARD ||
+      snapshot.behavior == StepperController::Behavior::REVERSE ||
+      snapshot.behavior == StepperController::Behavior::VELOCITY) {
+    // Taken over before we began.
+    setState(State::ABORTED);
+    return;
+  }
+
+  const uint32_t elapsed_ms = now_ms - start_ms_;
+  const int32_t desired_cdeg = desiredCdeg(elapsed_ms);
+  const int32_t ahead_cdeg = desiredCdeg(elapsed_ms + LOOKAHEAD_MS);
+  int32_t error_cdeg = desired_cdeg - snapshot.position_cdeg;
+  const int32_t abs_error_cdeg = error_cdeg >= 0 ? error_cdeg : -error_cdeg;
+  if (2 * abs_error_cdeg <= mask_controller_->getStepAngleCdeg()) {
+    // As close as the motor can get.
+    error_cdeg = 0;
+  }
+
+  const bool past_end =
+      elapsed_ms >= waypoints_[num_waypoints_ - 1u].time_ms;
+  if (past_end && error_cdeg == 0 &&
+      snapshot.behavior != StepperController::Behavior::VELOCITY) {
+    setState(State::FINISHED);
+    return;
+  }
+
+  // cdeg/ms to udeg/s is a factor of 10^7.
+  int64_t velocity_udeg_per_s =
+      static_cast<int64_t>(ahead_cdeg - desired_cdeg) * 10000000L /
+          static_cast<int32_t>(LOOKAHEAD_MS) +
+      static_cast<int64_t>(error_cdeg) * 10000000L /
+          static_cast<int32_t>(CORRECTION_MS);
+  const int64_t limit_udeg_per_s =
+      static_cast<int64_t>(mask_controller_->getCruiseSpeed()) * 10000L;
+  if (velocity_udeg_per_s > limit_udeg_per_s) {
+    velocity_udeg_per_s = limit_udeg_per_s;
+  } else if (velocity_udeg_per_s < -limit_udeg_per_s) {
+    velocity_udeg_per_s = -limit_udeg_per_s;
+  }
+  if (velocity_udeg_per_s != velocity_udeg_per_s_) {
+    velocity_udeg_per_s_ = static_cast<int32_t>(velocity_udeg_per_s);
+    velocity_commanded_ = true;
+    mask_controller_->setVelocity(velocity_udeg_per_s_);
+  }
+}
+
+TrajectoryTask::State TrajectoryTask::getState() const {
+  return state_;
+}
+
+void TrajectoryTask::setTriggerCallback(bool (*const cb)()) {
+  trigger_callback_ = cb;
+}
+
+void TrajectoryTask::setStateChangeCallback(void (*const cb)(State state)) {
+  state_change_callback_ = cb;
+}
+
+bool TrajectoryTask::begin(const bool armed) {
+  if (isActive() || num_waypoints_ == 0u) {
+    return false;
+  }
+
+  // Head for the nearest equivalent of the first waypoint, and shift the
+  // whole table by the same number of turns.
+  const int32_t first_cdeg = waypoints_[0].angle_cdeg;
+  const int32_t reached_cdeg = mask_controller_->rotateTo(first_cdeg,
+      MaskController::Direction::AUTO, false);
+  if (reached_cdeg == MaskController::INVALID_CDEG) {
+    return false;
+  }
+  const int32_t turns_cdeg = reached_cdeg - first_cdeg;
+  const int32_t half_turn_cdeg = MaskController::CENTIDEGREES_PER_ROTATION / 2;
+  offset_cdeg_ = (turns_cdeg >= 0 ? turns_cdeg + half_turn_cdeg :
+      turns_cdeg - half_turn_cdeg) / MaskController::CENTIDEGREES_PER_ROTATION *
+      MaskController::CENTIDEGREES_PER_ROTATION;
+
+  armed_ = armed;
+  velocity_udeg_per_s_ = 0;
+  velocity_commanded_ = false;
+  setState(State::WAITING);
+  return true;
+}
+
+int32_t TrajectoryTask::desiredCdeg(const uint32_t elapsed_ms) const {
+  if (elapsed_ms <= waypoints_[0].time_ms) {
+    return offset_cdeg_ + waypoints_[0].angle_cdeg;
+  }
+  for (uint8_t i = 1u; i < num_waypoints_; ++i) {
+    const Waypoint& to = waypoints_[i];
+    if (elapsed_ms < to.time_ms) {
+      const Waypoint& from = waypoints_[i - 1u];
+      const int64_t progress = static_cast<int64_t>(
+          to.angle_cdeg - from.angle_cdeg) * (elapsed_ms - from.time_ms);
+      return offset_cdeg_ + from.angle_cdeg + static_cast<int32_t>(
+          progress / static_cast<int64_t>(to.time_ms - from.time_ms));
+    }
+  }
+  return offset_cdeg_ + waypoints_[num_waypoints_ - 1u].angle_cdeg;
+}
+
+void TrajectoryTask::setState(const State state) {
+  if (state == state_) {
+    return;
+  }
+  state_ = state;
+  if (state_change_callback_ != nullptr) {
+    state_change_callback_(state_);
+  }
+}
+
+bool TrajectoryTask::isActive() const {
+  return state_ == State::WAITING || state_ == State::RUNNING;
+}
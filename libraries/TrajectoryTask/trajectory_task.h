@@ -0,0 +1,175 @@
+#ifndef TRAJECTORY_TASK_H_
+#define TRAJECTORY_TASK_H_
+
+#include "mask_controller.h"
+#include "stepper_controller.h"
+#include <Arduino.h>  // For int32_t, uint8_t, uint32_t
+
+// Operates a cooperative task that moves a MaskController along a table of
+// (time, angle) waypoints, interpolating linearly between them. The mask is
+// first brought to the first waypoint; the table's clock then starts either at
+// a given time or when a trigger fires.
+//
+// The trajectory is followed in velocity mode. The commanded rate is the
+// trajectory's average slope over the next LOOKAHEAD_MS, so that the motor
+// begins changing speed before each waypoint rather than after it, plus a
+// correction that closes any position error over CORRECTION_MS. Errors within
+// half a step are left alone so that the mask holds still during dwells. No
+// other functions should attempt to manipulate the MaskController or its
+// dependencies while a trajectory is waiting or running; call abort() first.
+class TrajectoryTask {
+ public:
+  // List of possible states the TrajectoryTask can be in.
+  enum class State : int {
+    IDLE = 0,  // No trajectory has been started. Default value.
+    WAITING,   // At or heading to the first waypoint, waiting for the start.
+    RUNNING,   // Following the trajectory.
+    FINISHED,  // The final waypoint has been reached.
+    ABORTED    // The trajectory was abandoned before finishing.
+  };
+
+  // A point the mask should pass through.
+  struct Waypoint {
+    uint32_t time_ms;    // Time since the start of the trajectory [ms].
+    int32_t angle_cdeg;  // Absolute mask angle [cdeg].
+  };
+
+  // Largest number of waypoints in a trajectory.
+  static const uint8_t MAX_WAYPOINTS = 16u;
+
+  // How far ahead of the present the trajectory's slope is taken [ms].
+  static const uint32_t LOOKAHEAD_MS = 200u;
+
+  // Time over which position errors are corrected [ms].
+  static const uint32_t CORRECTION_MS = 500u;
+
+  // Time between updates of the commanded rate [ms].
+  static const uint32_t UPDATE_PERIOD_MS = 20u;
+
+  // Constructs a new TrajectoryTask, designating the MaskController it will
+  // operate.
+  //
+  // mask_controller: The MaskController to operate.
+  explicit TrajectoryTask(MaskController* mask_controller);
+
+  // Appends a waypoint to the trajectory. Waypoints must be added in order of
+  // time. Angles are unwrapped relative to the first waypoint, so a change of
+  // 36000 between waypoints is a full turn; the first waypoint is taken at
+  // whichever of its equivalent angles is nearest the mask.
+  //
+  // time_ms: Time since the start of the trajectory [ms].
+  // angle_cdeg: Absolute mask angle [cdeg].
+  // Returns: True if the waypoint was added, or false if the table is full,
+  //          the time is out of order, or a trajectory is waiting or running.
+  bool addWaypoint(uint32_t time_ms, int32_t angle_cdeg);
+
+  // Retrieves the number of waypoints in the table.
+  //
+  // Returns: Number of waypoints.
+  uint8_t getWaypointCount() const;
+
+  // Discards all waypoints, abandoning any trajectory in progress.
+  void clear();
+
+  // Moves the mask to the first waypoint and starts the trajectory's clock at
+  // a given time.
+  //
+  // start_ms: The time at which the trajectory starts, as from millis() [ms].
+  //           A time already past starts the trajectory immediately, late.
+  // Returns: True if the trajectory was scheduled, or false if there are no
+  //          waypoints or a trajectory is already waiting or running.
+  bool startAt(unsigned long start_ms);
+
+  // Moves the mask to the first waypoint and starts the trajectory's clock
+  // when the trigger callback fires.
+  //
+  // Returns: True if the trajectory was armed, or false if there are no
+  //          waypoints or a trajectory is already waiting or running.
+  bool arm();
+
+  // Abandons a waiting or running trajectory, halting the mask immediately.
+  void abort();
+
+  // Starts the trajectory when due and updates the commanded rate. Call this
+  // as frequently as possible.
+  //
+  // now_ms: The current time, as from millis() [ms].
+  void step(unsigned long now_ms);
+
+  // Retrieves the current state of the TrajectoryTask. See the State
+  // enumeration.
+  //
+  // Returns: The current State enumerator describing the state of the task.
+  State getState() const;
+
+  // Establishes a function that reports whether an armed trajectory should
+  // start. It is polled from step().
+  //
+  // cb: The function to poll. Set to nullptr to remove the callback.
+  //  -> returns: True once the trajectory should start.
+  void setTriggerCallback(bool (*cb)());
+
+  // Establishes a function to call whenever the task changes state.
+  //
+  // cb: The function to invoke when the state changes. Set to nullptr to
+  //     remove the callback.
+  //  -> state: The state the task has just entered.
+  void setStateChangeCallback(void (*cb)(State state));
+
+ private:
+  // Moves the mask to the first waypoint and begins waiting.
+  //
+  // armed: Whether to wait for the trigger rather than the start time.
+  // Returns: True if the trajectory is now waiting.
+  bool begin(bool armed);
+
+  // Computes where the trajectory puts the mask at a given time.
+  //
+  // elapsed_ms: Time since the start of the trajectory [ms].
+  // Returns: The unwrapped mask angle [cdeg].
+  int32_t desiredCdeg(uint32_t elapsed_ms) const;
+
+  // Enters a state, announcing it via callback.
+  //
+  // state: The state to enter.
+  void setState(State state);
+
+  // Checks whether a trajectory is waiting or running.
+  //
+  // Returns: True if the task is waiting or running.
+  bool isActive() const;
+
+  // The MaskController to manipulate.
+  MaskController* const mask_controller_;
+
+  // The trajectory.
+  Waypoint waypoints_[MAX_WAYPOINTS];
+  uint8_t num_waypoints_;
+
+  // Whole turns added to every waypoint so the first lies nearest the mask
+  // [cdeg].
+  int32_t offset_cdeg_;
+
+  // Current state of the TrajectoryTask.
+  State state_;
+
+  // Whether a waiting trajectory starts on the trigger rather than at
+  // start_ms_.
+  bool armed_;
+
+  // When the trajectory started or is due to start, and when the commanded
+  // rate was last updated [ms].
+  unsigned long start_ms_;
+  unsigned long last_update_ms_;
+
+  // The rate last commanded of the mask [udeg/s], and whether one has been
+  // commanded yet.
+  int32_t velocity_udeg_per_s_;
+  bool velocity_commanded_;
+
+  // Callbacks to poll for the trigger and to invoke on state changes.
+  bool (*trigger_callback_)();
+  void (*state_change_callback_)(State state);
+};
+
+#endif
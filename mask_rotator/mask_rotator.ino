@@ -1,14 +1,25 @@
 #include <Arduino.h>
+#include "baud_negotiator.h"
 #include "bipolar_stepper.h"
+#include "command_parser.h"
+#include "exposure_trigger.h"
 #include "hall_switch.h"
 #include "mask_controller.h"
+#include "output_buffer.h"
 #include "index_task.h"
+#include "scan_task.h"
+#include "state_store.h"
 #include "stepper_controller.h"
 #include "timer_one.h"
+#include "tour_task.h"
+#include "trajectory_task.h"
 
 // Serial config
-const int SERIAL_BAUD_RATE = 19200;
-const int SERIAL_TIMEOUT_MS = 10;  // [ms]
+const unsigned long SERIAL_BAUD_RATE = 19200ul;  // Rate at power-up
+const unsigned long BAUD_CONFIRM_TIMEOUT_MS = 1000ul;  // [ms]
+const unsigned long MIN_TELEMETRY_PERIOD_MS = 20ul;  // [ms]
+const int TELEMETRY_MAX_BYTES = 64;  // Worst-case size of one sample
+const int SERIAL_TIMEOUT_MS = 10;  // Idle time ending a command's args [ms]
 enum Command : char {
   FORWARD_COMMAND = 'f',
   BACKWARD_COMMAND = 'b',
@@ -24,6 +35,39 @@ enum Command : char {
   PING_COMMAND = '?',
   PING_RESPONSE = '!',
   GO_TO_COMMAND = 'g',
+  SET_CRUISE_SPEED_COMMAND = 'c',
+  SET_START_SPEED_COMMAND = 'e',
+  SET_ACCELERATION_COMMAND = 'l',
+  SET_PROFILE_COMMAND = 'm',
+  SET_STEP_MODE_COMMAND = 'h',
+  ENQUEUE_MOVE_COMMAND = 'q',
+  QUEUE_FULL_RESPONSE = 'Q',
+  GET_QUEUE_COUNT_COMMAND = 'n',
+  FLUSH_QUEUE_COMMAND = 'k',
+  GET_OUTPUT_DROPS_COMMAND = 'o',
+  SET_BAUD_RATE_COMMAND = 'u',
+  SET_EVENTS_COMMAND = 'y',
+  MOVE_STARTED_EVENT = 'G',
+  TARGET_REACHED_EVENT = 'T',
+  STOPPED_EVENT = 'S',
+  INDEX_STATE_EVENT = 'N',
+  SET_TELEMETRY_COMMAND = 'd',
+  TELEMETRY_SAMPLE = 'D',
+  START_SCAN_COMMAND = 'j',
+  PAUSE_SCAN_COMMAND = 'w',
+  SCAN_EVENT = 'J',
+  SET_TRIGGER_COMMAND = '^',
+  SET_VELOCITY_COMMAND = 'v',
+  ADD_WAYPOINT_COMMAND = '+',
+  CLEAR_TRAJECTORY_COMMAND = '=',
+  START_TRAJECTORY_COMMAND = '>',
+  GET_TIME_COMMAND = '@',
+  TRAJECTORY_STATE_EVENT = 'W',
+  SET_BACKLASH_COMMAND = 'B',
+  ADD_TOUR_STOPS_COMMAND = 'A',
+  CLEAR_TOUR_COMMAND = 'C',
+  START_TOUR_COMMAND = 'R',
+  TOUR_EVENT = 'O',
   UNRECOGNIZED_COMMAND = 'x'
 };
 
@@ -34,9 +78,14 @@ const int PWMA_PIN = 3;
 const int BRKB_PIN = 8;
 const int DIRB_PIN = 13;
 const int PWMB_PIN = 11;
-const float GEAR_RATIO = 72.0/17.0;
+const int16_t MASK_GEAR_TEETH = 72;  // 72:17 gearing
+const int16_t MOTOR_GEAR_TEETH = 17;
 const int16_t MOTOR_STEPS = 200u;  // Motor steps per revolution
-uint32_t STEP_PERIOD_US = 8000u;  // [us]
+const uint16_t START_SPEED_SPS = 125u;  // [steps/s]
+const uint16_t CRUISE_SPEED_SPS = 500u;  // [steps/s]
+const uint32_t ACCELERATION_SPS2 = 500u;  // [steps/s^2]
+const StepperController::Profile DEFAULT_PROFILE =
+    StepperController::Profile::TRAPEZOIDAL;
 const MaskController::Direction PREFERRED_DIRECTION =
     MaskController::Direction::AUTO;
 
@@ -44,144 +93,684 @@ const MaskController::Direction PREFERRED_DIRECTION =
 const int HALL_SWITCH_POWER_PIN = 4;
 const int HALL_SWITCH_STATE_PIN = 5;
 
+// Exposure trigger config
+const int TRIGGER_OUTPUT_PIN = 6;
+const int TRIGGER_GATE_PIN = 7;
+
+// Trajectory start input config
+const int TRAJECTORY_TRIGGER_PIN = 2;  // Active low
+
 // Objects, state variables, etc.
 BipolarStepper stepper(BRKA_PIN, DIRA_PIN, PWMA_PIN, BRKB_PIN, DIRB_PIN, PWMB_PIN);
 HallSwitch hall_switch(HALL_SWITCH_POWER_PIN, HALL_SWITCH_STATE_PIN);
+ExposureTrigger exposure_trigger(TRIGGER_OUTPUT_PIN, TRIGGER_GATE_PIN);
 StepperController motor_controller(&stepper, MOTOR_STEPS);
-MaskController mask_controller(&motor_controller, GEAR_RATIO);
+MaskController mask_controller(&motor_controller, MASK_GEAR_TEETH,
+    MOTOR_GEAR_TEETH);
 IndexTask index_task(&mask_controller, &hall_switch);
+StateStore state_store(&mask_controller, &index_task, &stepper);
+ScanTask scan_task(&mask_controller);
+TrajectoryTask trajectory_task(&mask_controller);
+TourTask tour_task(&mask_controller);
+CommandParser command_parser(&commandTakesArgs, SERIAL_TIMEOUT_MS);
+OutputBuffer output;
+BaudNegotiator baud_negotiator(&Serial, SERIAL_BAUD_RATE,
+    BAUD_CONFIRM_TIMEOUT_MS);
+bool reply_framed = false;
+bool events_enabled = false;
+unsigned long telemetry_period_ms = 0u;  // Zero when not streaming
+unsigned long last_telemetry_ms = 0u;
+bool telemetry_framed = false;
 TimerOne timer;
 enum class Mode {
   NONE,
   ABSOLUTE,
   RELATIVE
 } mode = Mode::ABSOLUTE;
+StepperController::Profile profile = DEFAULT_PROFILE;
 
 // Called once at the start of the progrom; initializes all hardware and tasks.
 void setup() {
-  Serial.begin(SERIAL_BAUD_RATE);
-  Serial.setTimeout(SERIAL_TIMEOUT_MS);
-  stepper.initialize();
-  stepper.enable();
+  baud_negotiator.begin();
+  motor_controller.setStartSpeed(START_SPEED_SPS);
+  motor_controller.setCruiseSpeed(CRUISE_SPEED_SPS);
+  motor_controller.setAcceleration(ACCELERATION_SPS2);
+  motor_controller.setProfile(DEFAULT_PROFILE);
+  hall_switch.setPositionCallback(&motorPositionSteps);
   hall_switch.init();
+  exposure_trigger.init();
   index_task.init();
   index_task.setIndexEventCallback(&actOnIndexEvent);
+  index_task.setStateChangeCallback(&actOnIndexStateChange);
+  // Pick up where we left off if the mask hasn't moved since. The motor is
+  // only energized afterwards, in the phase it was left in.
+  state_store.restore();
+  stepper.initialize();
+  stepper.enable();
+  scan_task.setScanEventCallback(&actOnScanEvent);
+  tour_task.setTourEventCallback(&actOnTourEvent);
+  pinMode(TRAJECTORY_TRIGGER_PIN, INPUT_PULLUP);
+  trajectory_task.setTriggerCallback(&trajectoryTriggered);
+  trajectory_task.setStateChangeCallback(&actOnTrajectoryStateChange);
+  // The step timer stays stopped until the controller asks for it.
   timer.initialize();
-  timer.attachInterrupt(update, STEP_PERIOD_US);
+  timer.stop();
+  timer.attachInterrupt(update);
+  motor_controller.setWakeCallback(&wakeTimer);
+  motor_controller.setSettleCallback(&settleAfterArrival);
+  motor_controller.setDepartureCallback(&mayDepart);
+  motor_controller.setReleaseCallback(&releaseTrigger);
 }
 
 // Called repeatedly: updates tasks and looks for new actions to take based on
 // command inputs.
 void loop() {
   index_task.step();
+  scan_task.step();
+  trajectory_task.step(millis());
+  tour_task.step();
+  state_store.step();
+  pushMotionEvents();
+  pushTelemetry();
+  output.drain(Serial);
+  stepBaudNegotiation();
 
-  // Process input.
-  if (Serial.available()) {
-    const char command = Serial.peek();
-    switch (command) {
-      case FORWARD_COMMAND:
-        Serial.read();
-        mask_controller.forward();
-        Serial.write(FORWARD_COMMAND);
-        Serial.println();
-        break;
-      case BACKWARD_COMMAND:
-        Serial.read();
-        mask_controller.reverse();
-        Serial.write(BACKWARD_COMMAND);
-        Serial.println();
+  // Process input a byte at a time so that loop() never waits on the host.
+  CommandParser::Command command;
+  while (Serial.available()) {
+    command_parser.feed(Serial.read(), millis());
+    // A binary batch frame completes several commands at once.
+    while (command_parser.next(&command, millis())) {
+      executeCommand(command);
+      output.drain(Serial);
+    }
+  }
+  while (command_parser.next(&command, millis())) {
+    executeCommand(command);
+  }
+  output.drain(Serial);
+}
+
+// Reports whether a command character is followed by numeric arguments.
+bool commandTakesArgs(const char code) {
+  switch (code) {
+    case GO_TO_COMMAND:
+    case ENQUEUE_MOVE_COMMAND:
+    case SET_CRUISE_SPEED_COMMAND:
+    case SET_START_SPEED_COMMAND:
+    case SET_ACCELERATION_COMMAND:
+    case SET_PROFILE_COMMAND:
+    case SET_STEP_MODE_COMMAND:
+    case SET_BAUD_RATE_COMMAND:
+    case SET_EVENTS_COMMAND:
+    case SET_TELEMETRY_COMMAND:
+    case START_SCAN_COMMAND:
+    case PAUSE_SCAN_COMMAND:
+    case SET_TRIGGER_COMMAND:
+    case SET_VELOCITY_COMMAND:
+    case ADD_WAYPOINT_COMMAND:
+    case START_TRAJECTORY_COMMAND:
+    case SET_BACKLASH_COMMAND:
+    case ADD_TOUR_STOPS_COMMAND:
+    case START_TOUR_COMMAND:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Carries out a complete command, however it was encoded, and replies to the
+// host in the same encoding.
+void executeCommand(const CommandParser::Command& command) {
+  reply_framed = command.framed;
+  switch (command.code) {
+    case FORWARD_COMMAND:
+      abortSequences();
+      mask_controller.forward();
+      sendResponse(FORWARD_COMMAND);
+      break;
+    case BACKWARD_COMMAND:
+      abortSequences();
+      mask_controller.reverse();
+      sendResponse(BACKWARD_COMMAND);
+      break;
+    case STOP_COMMAND:
+      abortSequences();
+      mask_controller.stop();
+      exposure_trigger.release();
+      sendResponse(STOP_COMMAND);
+      break;
+    case GET_POSITION_COMMAND:
+      sendResponse(GET_POSITION_COMMAND, centidegreesToSerial(
+          mask_controller.getSnapshot(true).position_cdeg));
+      break;
+    case GET_TARGET_COMMAND:
+      sendResponse(GET_TARGET_COMMAND, centidegreesToSerial(
+          mask_controller.getSnapshot(true).target_cdeg));
+      break;
+    case SET_ZERO_COMMAND:
+      mask_controller.setZero();
+      sendResponse(SET_ZERO_COMMAND);
+      break;
+    case ENTER_RELATIVE_MODE_COMMAND:
+      mode = Mode::RELATIVE;
+      sendResponse(ENTER_RELATIVE_MODE_COMMAND);
+      break;
+    case ENTER_ABSOLUTE_MODE_COMMAND:
+      mode = Mode::ABSOLUTE;
+      sendResponse(ENTER_ABSOLUTE_MODE_COMMAND);
+      break;
+    case LOCATE_INDEX_COMMAND:
+      abortSequences();
+      index_task.index();
+      sendResponse(LOCATE_INDEX_COMMAND);
+      break;
+    case PING_COMMAND:
+      // A ping is also how the host confirms a new baud rate.
+      baud_negotiator.confirm();
+      sendResponse(PING_RESPONSE);
+      break;
+    case GO_TO_COMMAND: {
+      abortSequences();
+      const int32_t serial_cdeg = serialToCentidegrees(command.args[0]);
+      int32_t actual_cdeg = 0;
+      if (mode == Mode::ABSOLUTE) {
+        actual_cdeg = mask_controller.rotateTo(serial_cdeg, profile,
+            PREFERRED_DIRECTION);
+      } else if (mode == Mode::RELATIVE) {
+        actual_cdeg = mask_controller.rotateBy(serial_cdeg, profile);
+      }
+      sendResponse(GO_TO_COMMAND, centidegreesToSerial(actual_cdeg));
+      break;
+    }
+    case ENQUEUE_MOVE_COMMAND: {
+      // Expects an angle and an optional dwell time, e.g. "q9000,500".
+      abortSequences();
+      const int32_t serial_cdeg = serialToCentidegrees(command.args[0]);
+      const uint16_t dwell_ms = constrain(command.args[1], 0L, 0xFFFFL);
+      int32_t queued_cdeg = MaskController::INVALID_CDEG;
+      if (mode == Mode::ABSOLUTE) {
+        queued_cdeg = mask_controller.enqueueMoveTo(serial_cdeg,
+            PREFERRED_DIRECTION, profile, dwell_ms);
+      } else if (mode == Mode::RELATIVE) {
+        queued_cdeg = mask_controller.enqueueMoveBy(serial_cdeg, profile,
+            dwell_ms);
+      }
+      if (queued_cdeg == MaskController::INVALID_CDEG) {
+        sendResponse(QUEUE_FULL_RESPONSE);
         break;
-      case STOP_COMMAND:
-        Serial.read();
-        mask_controller.stop();
-        Serial.write(STOP_COMMAND);
-        Serial.println();
+      }
+      sendResponse(ENQUEUE_MOVE_COMMAND, centidegreesToSerial(queued_cdeg));
+      break;
+    }
+    case GET_QUEUE_COUNT_COMMAND:
+      sendResponse(GET_QUEUE_COUNT_COMMAND,
+          mask_controller.getQueuedMoveCount());
+      break;
+    case FLUSH_QUEUE_COMMAND:
+      abortSequences();
+      mask_controller.flushQueue();
+      sendResponse(FLUSH_QUEUE_COMMAND);
+      break;
+    case SET_CRUISE_SPEED_COMMAND: {
+      const int32_t actual_cdeg_per_s = mask_controller.setCruiseSpeed(
+          serialToCentidegrees(command.args[0]));
+      sendResponse(SET_CRUISE_SPEED_COMMAND,
+          centidegreesToSerial(actual_cdeg_per_s));
+      break;
+    }
+    case SET_START_SPEED_COMMAND: {
+      const int32_t actual_cdeg_per_s = mask_controller.setStartSpeed(
+          serialToCentidegrees(command.args[0]));
+      sendResponse(SET_START_SPEED_COMMAND,
+          centidegreesToSerial(actual_cdeg_per_s));
+      break;
+    }
+    case SET_ACCELERATION_COMMAND: {
+      const int32_t actual_cdeg_per_s2 = mask_controller.setAcceleration(
+          serialToCentidegrees(command.args[0]));
+      sendResponse(SET_ACCELERATION_COMMAND,
+          centidegreesToSerial(actual_cdeg_per_s2));
+      break;
+    }
+    case SET_BACKLASH_COMMAND:
+      // Tells automatic direction choice how much slack a reversal takes up.
+      mask_controller.setBacklash(serialToCentidegrees(command.args[0]));
+      sendResponse(SET_BACKLASH_COMMAND,
+          centidegreesToSerial(mask_controller.getBacklash()));
+      break;
+    case SET_PROFILE_COMMAND: {
+      // Selects the speed profile for subsequent go-to commands.
+      const long requested_profile = command.args[0];
+      if (requested_profile <
+              static_cast<long>(StepperController::Profile::CONSTANT) ||
+          requested_profile >
+              static_cast<long>(StepperController::Profile::S_CURVE)) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
-      case GET_POSITION_COMMAND:
-        Serial.read();
-        Serial.write(GET_POSITION_COMMAND);
-        Serial.println(degreesToSerial(mask_controller.getPositionDeg(true)));
+      }
+      profile = static_cast<StepperController::Profile>(requested_profile);
+      sendResponse(SET_PROFILE_COMMAND, requested_profile);
+      break;
+    }
+    case SET_STEP_MODE_COMMAND: {
+      // Switches between full-step, half-step and microstepping drive.
+      const long requested_mode = command.args[0];
+      if (requested_mode <
+              static_cast<long>(BipolarStepper::StepMode::FULL_STEP) ||
+          requested_mode >
+              static_cast<long>(BipolarStepper::StepMode::MICROSTEP)) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
-      case GET_TARGET_COMMAND:
-        Serial.read();
-        Serial.write(GET_TARGET_COMMAND);
-        Serial.println(degreesToSerial(mask_controller.getTargetDeg(true)));
+      }
+      abortSequences();
+      index_task.abort();
+      motor_controller.setStepMode(
+          static_cast<BipolarStepper::StepMode>(requested_mode));
+      sendResponse(SET_STEP_MODE_COMMAND, requested_mode);
+      break;
+    }
+    case GET_OUTPUT_DROPS_COMMAND: {
+      // Reports responses lost to a full output buffer and discarded binary
+      // frames, then starts afresh.
+      const int32_t counts[] = {output.getDroppedMessageCount(),
+          output.getDroppedByteCount(), command_parser.getFrameErrorCount()};
+      if (sendResponse(GET_OUTPUT_DROPS_COMMAND, counts, 3u)) {
+        output.resetDroppedCounts();
+      }
+      break;
+    }
+    case SET_BAUD_RATE_COMMAND:
+      // The acknowledgement goes out at the old rate. The host should then
+      // switch and ping within BAUD_CONFIRM_TIMEOUT_MS.
+      if (command.args[0] <= 0 || !baud_negotiator.request(command.args[0])) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
-      case SET_ZERO_COMMAND:
-        Serial.read();
-        mask_controller.setZero();
-        Serial.write(SET_ZERO_COMMAND);
-        Serial.println();
+      }
+      sendResponse(SET_BAUD_RATE_COMMAND, command.args[0]);
+      break;
+    case SET_EVENTS_COMMAND:
+      // Turns unsolicited motion and index state events on (1) or off (0).
+      events_enabled = command.args[0] != 0;
+      sendResponse(SET_EVENTS_COMMAND, events_enabled ? 1 : 0);
+      break;
+    case SET_TELEMETRY_COMMAND:
+      // Streams samples every given number of milliseconds, in the encoding
+      // of this command, or stops streaming if zero.
+      if (command.args[0] <= 0) {
+        telemetry_period_ms = 0u;
+      } else {
+        const unsigned long period_ms = command.args[0];
+        telemetry_period_ms = period_ms < MIN_TELEMETRY_PERIOD_MS ?
+            MIN_TELEMETRY_PERIOD_MS : period_ms;
+        telemetry_framed = command.framed;
+        last_telemetry_ms = millis() - telemetry_period_ms;
+      }
+      sendResponse(SET_TELEMETRY_COMMAND, telemetry_period_ms);
+      break;
+    case START_SCAN_COMMAND: {
+      // Expects a start angle, increment, point count, and optionally a dwell
+      // time, direction and pass count, e.g. "j0,3000,12,2000,1,1". Omitting
+      // the direction uses the preferred one; omitting the pass count makes a
+      // single pass, while zero passes repeat until stopped.
+      const long requested_direction = command.args[4];
+      if (command.args[2] <= 0 || command.args[2] > 0xFFFFL ||
+          requested_direction < 0 || requested_direction >
+              static_cast<long>(MaskController::Direction::AUTO)) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
-      case ENTER_RELATIVE_MODE_COMMAND:
-        Serial.read();
-        mode = Mode::RELATIVE;
-        Serial.write(ENTER_RELATIVE_MODE_COMMAND);
-        Serial.println();
+      }
+      ScanTask::Scan scan;
+      scan.start_cdeg = serialToCentidegrees(command.args[0]);
+      scan.increment_cdeg = serialToCentidegrees(command.args[1]);
+      scan.point_count = command.args[2];
+      scan.dwell_ms = constrain(command.args[3], 0L, 0xFFFFL);
+      scan.pass_count = command.num_args < 6u ? 1u :
+          constrain(command.args[5], 0L, 0xFFFFL);
+      scan.direction = requested_direction == 0 ? PREFERRED_DIRECTION :
+          static_cast<MaskController::Direction>(requested_direction);
+      scan.profile = profile;
+      abortSequences();
+      if (!scan_task.start(scan)) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
-      case ENTER_ABSOLUTE_MODE_COMMAND:
-        Serial.read();
-        mode = Mode::ABSOLUTE;
-        Serial.write(ENTER_ABSOLUTE_MODE_COMMAND);
-        Serial.println();
+      }
+      sendResponse(START_SCAN_COMMAND, scan.point_count);
+      break;
+    }
+    case PAUSE_SCAN_COMMAND:
+      // Pauses the scan (1) or resumes it (0).
+      if (command.args[0] != 0) {
+        scan_task.pause();
+      } else {
+        scan_task.resume();
+      }
+      sendResponse(PAUSE_SCAN_COMMAND,
+          static_cast<int32_t>(scan_task.getState()));
+      break;
+    case SET_VELOCITY_COMMAND:
+      // Tracks at a signed mask rate in microdegrees per second; "v0" ramps
+      // to a stop.
+      abortSequences();
+      sendResponse(SET_VELOCITY_COMMAND,
+          mask_controller.setVelocity(command.args[0]));
+      break;
+    case ADD_WAYPOINT_COMMAND:
+      // Expects a time from the start of the trajectory and an absolute
+      // angle, e.g. "+1500,9000". Waypoints go in order of time.
+      if (command.args[0] < 0 ||
+          !trajectory_task.addWaypoint(command.args[0],
+              serialToCentidegrees(command.args[1]))) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
-      case LOCATE_INDEX_COMMAND:
-        Serial.read();
-        index_task.index();
-        Serial.write(LOCATE_INDEX_COMMAND);
-        Serial.println();
+      }
+      sendResponse(ADD_WAYPOINT_COMMAND, trajectory_task.getWaypointCount());
+      break;
+    case CLEAR_TRAJECTORY_COMMAND:
+      trajectory_task.clear();
+      sendResponse(CLEAR_TRAJECTORY_COMMAND);
+      break;
+    case START_TRAJECTORY_COMMAND: {
+      // Moves to the first waypoint, then starts the trajectory at the given
+      // device time (see GET_TIME_COMMAND), or on the trigger input if no
+      // time is given.
+      abortSequences();
+      const bool started = command.num_args == 0u ? trajectory_task.arm() :
+          trajectory_task.startAt(command.args[0]);
+      if (!started) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
-      case PING_COMMAND:
-        Serial.read();
-        Serial.write(PING_RESPONSE);
-        Serial.println();
+      }
+      sendResponse(START_TRAJECTORY_COMMAND,
+          trajectory_task.getWaypointCount());
+      break;
+    }
+    case ADD_TOUR_STOPS_COMMAND: {
+      // Adds up to CommandParser::MAX_ARGS angles to visit, in any order,
+      // e.g. "A9000,500,27000".
+      bool added = true;
+      for (uint8_t i = 0u; i < command.num_args && added; ++i) {
+        added = tour_task.addStop(serialToCentidegrees(command.args[i]));
+      }
+      if (!added) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
-      case GO_TO_COMMAND: {
-        Serial.read();  // Get the command character out of the buffer.
-        float serial_deg = serialToDegrees(Serial.parseInt());
-        float actual_deg = 0.0f;
-        if (mode == Mode::ABSOLUTE) {
-          actual_deg = mask_controller.rotateTo(serial_deg, PREFERRED_DIRECTION);
-        } else if (mode == Mode::RELATIVE) {
-          actual_deg = mask_controller.rotateBy(serial_deg);
-        }
-        Serial.write(GO_TO_COMMAND);
-        Serial.println(degreesToSerial(actual_deg));
+      }
+      sendResponse(ADD_TOUR_STOPS_COMMAND, tour_task.getStopCount());
+      break;
+    }
+    case CLEAR_TOUR_COMMAND:
+      tour_task.clear();
+      sendResponse(CLEAR_TOUR_COMMAND);
+      break;
+    case START_TOUR_COMMAND:
+      // Visits the added angles in the fastest order found, holding at each
+      // for an optional dwell time, e.g. "R2000". Replies with the predicted
+      // motion time in milliseconds.
+      abortSequences();
+      if (!tour_task.start(profile, constrain(command.args[0], 0L, 0xFFFFL))) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
       }
-      default:
-        Serial.read();  // Discard character if we don't recognize it.
-        Serial.write(UNRECOGNIZED_COMMAND);
-        Serial.println();
+      sendResponse(START_TOUR_COMMAND, tour_task.getPlannedMs());
+      break;
+    case GET_TIME_COMMAND:
+      // Lets the host schedule against the device clock.
+      sendResponse(GET_TIME_COMMAND, static_cast<int32_t>(millis()));
+      break;
+    case SET_TRIGGER_COMMAND: {
+      // Expects a mode (0 off, 1 pulse, 2 level), then optionally a settle
+      // time, a pulse width and whether to wait on the gate input, e.g.
+      // "^1,200,10,1".
+      const long requested_mode = command.args[0];
+      if (requested_mode < static_cast<long>(ExposureTrigger::Mode::OFF) ||
+          requested_mode > static_cast<long>(ExposureTrigger::Mode::LEVEL)) {
+        sendResponse(UNRECOGNIZED_COMMAND);
         break;
+      }
+      exposure_trigger.setTiming(constrain(command.args[1], 0L, 0xFFFFL),
+          constrain(command.args[2], 0L, 0xFFFFL));
+      exposure_trigger.setGateEnabled(command.args[3] != 0);
+      exposure_trigger.setMode(
+          static_cast<ExposureTrigger::Mode>(requested_mode));
+      sendResponse(SET_TRIGGER_COMMAND, requested_mode);
+      break;
     }
+    default:
+      sendResponse(UNRECOGNIZED_COMMAND);
+      break;
+  }
+}
+
+// Abandons any scan, trajectory or tour in progress, before another command
+// takes over the mask.
+void abortSequences() {
+  scan_task.abort();
+  trajectory_task.abort();
+  tour_task.abort();
+}
+
+// Converts an angle from serial convention to centidegrees. The serial
+// convention is also centidegrees, so no arithmetic is needed.
+int32_t serialToCentidegrees(const int32_t serial) {
+  return serial;
+}
+
+// Converts an angle from centidegrees to serial convention.
+int32_t centidegreesToSerial(const int32_t centidegrees) {
+  return centidegrees;
+}
+
+// Reports motion events recorded by the motor controller since the last call,
+// if the host has asked for them.
+void pushMotionEvents() {
+  const uint8_t events = motor_controller.takeEvents();
+  if (!events_enabled || events == 0u) {
+    return;
+  }
+  const MaskController::Snapshot snapshot = mask_controller.getSnapshot(true);
+  const bool started = events & StepperController::EVENT_MOVE_STARTED;
+  const bool reached = events & StepperController::EVENT_TARGET_REACHED;
+  // If a move both started and finished since we last looked, the present
+  // behavior tells us which came first: a queued move starting after the
+  // previous one finished leaves us targeting.
+  const bool reached_last = snapshot.behavior ==
+      StepperController::Behavior::REACHED_TARGET;
+  if (reached && !reached_last) {
+    sendResponse(TARGET_REACHED_EVENT, snapshot.position_cdeg);
+  }
+  if (started) {
+    sendResponse(MOVE_STARTED_EVENT, snapshot.target_cdeg);
+  }
+  if (reached && reached_last) {
+    sendResponse(TARGET_REACHED_EVENT, snapshot.position_cdeg);
+  }
+  if (events & StepperController::EVENT_STOPPED) {
+    sendResponse(STOPPED_EVENT, snapshot.position_cdeg);
   }
 }
 
-// Converts an angle from serial convention to degrees.
-float serialToDegrees(const int32_t serial) {
-  return serial / 100.0f;
+// Sends a telemetry sample when one is due. Samples are skipped rather than
+// queued while the output buffer is busy, so the stream never backs up.
+void pushTelemetry() {
+  if (telemetry_period_ms == 0u) {
+    return;
+  }
+  const unsigned long now_ms = millis();
+  if (now_ms - last_telemetry_ms < telemetry_period_ms) {
+    return;
+  }
+  // Keep to the cadence even if we're a little late this time.
+  last_telemetry_ms += telemetry_period_ms;
+  if (now_ms - last_telemetry_ms >= telemetry_period_ms) {
+    last_telemetry_ms = now_ms;
+  }
+  if (output.availableForWrite() < TELEMETRY_MAX_BYTES) {
+    return;
+  }
+
+  const MaskController::Snapshot snapshot = mask_controller.getSnapshot(true);
+  const int32_t sample[] = {
+    static_cast<int32_t>(now_ms),
+    centidegreesToSerial(snapshot.position_cdeg),
+    centidegreesToSerial(snapshot.target_cdeg),
+    static_cast<int32_t>(snapshot.behavior),
+    static_cast<int32_t>(index_task.getState()),
+    hall_switch.isTriggered() ? 1 : 0
+  };
+  sendMessage(TELEMETRY_SAMPLE, sample, sizeof(sample) / sizeof(sample[0]),
+      telemetry_framed);
 }
 
-// Convets an angle from degrees to serial convention. There is no overflow
-// protection.
-int32_t degreesToSerial(const float degrees) {
-  return static_cast<int32_t>(round(degrees * 100.0f));
+// Carries out any baud rate change once its acknowledgement has been sent.
+void stepBaudNegotiation() {
+  const BaudNegotiator::Event event =
+      baud_negotiator.step(!output.isEmpty(), millis());
+  if (event == BaudNegotiator::Event::NONE) {
+    return;
+  }
+  // Anything half-received straddles the change and is garbage.
+  command_parser.reset();
+  while (Serial.available()) {
+    Serial.read();
+  }
+  if (event == BaudNegotiator::Event::FELL_BACK) {
+    // Let the host know which rate we've returned to.
+    sendResponse(SET_BAUD_RATE_COMMAND, baud_negotiator.getBaudRate());
+  }
+}
+
+// Queues a response consisting of a code alone for transmission.
+void sendResponse(const char code) {
+  sendResponse(code, nullptr, 0u);
+}
+
+// Queues a response consisting of a code followed by a value for
+// transmission.
+void sendResponse(const char code, const int32_t value) {
+  sendResponse(code, &value, 1u);
+}
+
+// Queues a response for transmission, framed if the command being answered
+// was framed and as a line of text otherwise. Responses not prompted by a
+// command follow the encoding of the most recent command.
+//
+// Returns: True if the response fit in the output buffer.
+bool sendResponse(const char code, const int32_t* const values,
+    const uint8_t num_values) {
+  return sendMessage(code, values, num_values, reply_framed);
+}
+
+// Queues a message for transmission, either as a binary frame or as a line of
+// text with comma-separated values.
+//
+// Returns: True if the message fit in the output buffer.
+bool sendMessage(const char code, const int32_t* const values,
+    const uint8_t num_values, const bool framed) {
+  output.beginMessage();
+  if (framed) {
+    CommandParser::writeFrame(output, code, values, num_values);
+  } else {
+    output.write(code);
+    for (uint8_t i = 0u; i < num_values; ++i) {
+      if (i > 0u) {
+        output.write(',');
+      }
+      output.print(values[i]);
+    }
+    output.println();
+  }
+  return output.endMessage();
 }
 
 void actOnIndexEvent(const IndexTask::IndexEvent event,
-    const float index_offset_deg) {
-  (void)(index_offset_deg);  // Denote index offset parameter as unused.
+    const int32_t index_offset_cdeg) {
+  (void)(index_offset_cdeg);  // Denote index offset parameter as unused.
   if (event == IndexTask::IndexEvent::INDEX_FOUND) {
-    Serial.write(FOUND_INDEX_RESPONSE);
-    Serial.println();
+    sendResponse(FOUND_INDEX_RESPONSE);
   } else if (event == IndexTask::IndexEvent::INDEX_NOT_FOUND) {
-    Serial.write(COULD_NOT_FIND_INDEX_RESPONSE);
-    Serial.println();
+    sendResponse(COULD_NOT_FIND_INDEX_RESPONSE);
   }
 }
 
-// Function run via timer interrupt to actuate motor.
+// Reports the progress of a scan as the event, point and pass concerned.
+void actOnScanEvent(const ScanTask::ScanEvent event, const uint16_t point,
+    const uint16_t pass) {
+  const int32_t values[] = {static_cast<int32_t>(event), point, pass};
+  sendResponse(SCAN_EVENT, values, 3u);
+}
+
+// Reports the progress of a tour as the event, the number of stops visited
+// before the one concerned, and its angle.
+void actOnTourEvent(const TourTask::TourEvent event, const uint8_t stop,
+    const int32_t angle_cdeg) {
+  const int32_t values[] = {static_cast<int32_t>(event), stop,
+      centidegreesToSerial(angle_cdeg)};
+  sendResponse(TOUR_EVENT, values, 3u);
+}
+
+// Reports trajectory task state changes.
+void actOnTrajectoryStateChange(const TrajectoryTask::State state) {
+  sendResponse(TRAJECTORY_STATE_EVENT, static_cast<int32_t>(state));
+}
+
+// Reports whether the trajectory start input is asserted.
+bool trajectoryTriggered() {
+  return digitalRead(TRAJECTORY_TRIGGER_PIN) == LOW;
+}
+
+// Reports index task state changes, if the host has asked for events.
+void actOnIndexStateChange(const IndexTask::State state) {
+  if (events_enabled) {
+    sendResponse(INDEX_STATE_EVENT, static_cast<int32_t>(state));
+  }
+}
+
+// Function run via timer interrupt to actuate motor. Reprograms the timer to
+// fire when the next step is due, or stops it once motion has ended.
 void update() {
-  motor_controller.update();
+  const uint32_t period_us = motor_controller.update();
+  if (period_us == 0u) {
+    timer.stop();
+  } else {
+    timer.setPeriod(period_us);
+  }
+}
+
+#if defined(__AVR__)
+// Captures Hall switch edges. HALL_SWITCH_STATE_PIN (D5) is on port D, whose
+// pins raise PCINT2. Elsewhere the HallSwitch polls for edges instead.
+ISR(PCINT2_vect) {
+  hall_switch.onPinChange();
+}
+#endif
+
+// Reports the motor position for each Hall switch edge. Called from the
+// pin-change interrupt, which the step interrupt can't be in the middle of.
+int32_t motorPositionSteps() {
+  return motor_controller.getSnapshot().position_steps;
+}
+
+// Runs the exposure trigger after the mask arrives at a target. Called from
+// update().
+uint32_t settleAfterArrival(const uint32_t since_arrival_us) {
+  return exposure_trigger.onArrival(since_arrival_us);
+}
+
+// Lets the exposure trigger hold back the next queued move. Called from
+// update().
+bool mayDepart() {
+  return exposure_trigger.onDeparture();
+}
+
+// Ends any trigger output before the mask moves other than from the queue.
+// Called by the motor controller when such motion is commanded.
+void releaseTrigger() {
+  exposure_trigger.release();
+}
+
+// Restarts the stopped step timer so that update() runs after a given period.
+void wakeTimer(const uint32_t period_us) {
+  timer.setPeriod(period_us);
+  timer.start();
 }